@@ -3,6 +3,7 @@
 mkdir -p "deps/gmod"
 mkdir -p "deps/openvr/lib_linux32"
 mkdir -p "deps/openvr/lib_linux64"
+mkdir -p "deps/vulkan"
 
 if [ ! -f "deps/gmod/Interface.h" ]; then
     wget -O deps/gmod/tmp.zip https://github.com/Facepunch/gmod-module-base/archive/15bf18f369a41ac3d4eba29ee0679f386ec628b7.zip
@@ -16,6 +17,21 @@ if [ ! -f "deps/openvr/lib_linux32/libopenvr_api.so" ]; then
     wget -O deps/openvr/lib_linux64/libopenvr_api.so https://github.com/ValveSoftware/openvr/raw/master/bin/linux64/libopenvr_api.so
 fi
 
+if [ ! -f "deps/vulkan/vulkan_core.h" ]; then
+    wget -O deps/vulkan/vulkan_core.h https://github.com/KhronosGroup/Vulkan-Headers/raw/v1.2.203/include/vulkan/vulkan_core.h
+    wget -O deps/vulkan/vk_platform.h https://github.com/KhronosGroup/Vulkan-Headers/raw/v1.2.203/include/vulkan/vk_platform.h
+fi
+
+# ./build.sh test builds and runs the kernel tests instead of the module.
+if [ "$1" = "test" ]; then
+    mkdir -p build
+    for t in euler codec ik; do
+        g++ -m64 -O3 -I ./deps src/test_$t.cpp -o build/test_$t -L ./deps/openvr/lib_linux64 -l openvr_api -lGL -ldl -lpthread -Wl,-rpath='$ORIGIN/../deps/openvr/lib_linux64' || exit 1
+        ./build/test_$t || exit 1
+    done
+    exit 0
+fi
+
 g++ -fPIC -shared -m32 -O3 -I ./deps src/vrmod.cpp -o install/GarrysMod/garrysmod/lua/bin/gmcl_vrmod_linux.dll -L ./deps/openvr/lib_linux32 -l openvr_api -ldl -Wl,-rpath='$ORIGIN'
 g++ -fPIC -shared -m64 -O3 -I ./deps src/vrmod.cpp -o install/GarrysMod/garrysmod/lua/bin/gmcl_vrmod_linux64.dll -L ./deps/openvr/lib_linux64 -l openvr_api -ldl -Wl,-rpath='$ORIGIN'
 
@@ -0,0 +1,160 @@
+// Error and throughput test for the pose codec behind EncodePoses/DecodePoses. Streams
+// random hand-like motion for 16 slots through EncodeFrame and DecodeFrame, delta encoded
+// against the previous frame, and checks the reconstruction error. Built and run by
+//
+//     ./build.sh test
+
+#include "vrmod.cpp"
+#include <random>
+
+#define CODEC_TEST_FRAMES       200000
+#define CODEC_TEST_MAX_POS_ERROR    (0.5f / CODEC_POS_SCALE + 1e-6f)   // meters
+#define CODEC_TEST_MAX_ROT_ERROR    0.15                                // degrees
+
+typedef struct {
+    float pos[3];
+    float q[4];
+} testPose;
+
+void NormalizeQuat(float q[4]) {
+    float len = sqrtf(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+    for (int i = 0; i < 4; i++)
+        q[i] /= len;
+}
+
+// Moves every pose by up to 3 cm and a few degrees, roughly a fast hand at 90 Hz, and
+// keeps it within a couple of meters of the origin.
+void StepPoses(std::mt19937* rng, testPose* poses, int count) {
+    std::uniform_real_distribution<float> step(-0.03f, 0.03f);
+    std::normal_distribution<float> turn(0.0f, 0.02f);
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < 3; j++)
+            poses[i].pos[j] = fminf(fmaxf(poses[i].pos[j] + step(*rng), -2.0f), 2.0f);
+        for (int j = 0; j < 4; j++)
+            poses[i].q[j] += turn(*rng);
+        NormalizeQuat(poses[i].q);
+    }
+}
+
+double QuatAngle(const float a[4], const float b[4]) {
+    double dot = fabs((double)a[0] * b[0] + (double)a[1] * b[1] + (double)a[2] * b[2] + (double)a[3] * b[3]);
+    return 2.0 * acos(dot > 1.0 ? 1.0 : dot) * (180.0 / M_PI);
+}
+
+int CheckRoundTrip() {
+    static codecFrame history[CODEC_HISTORY], peer[CODEC_HISTORY];
+    testPose poses[MAX_CODEC_SLOTS];
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    for (int i = 0; i < MAX_CODEC_SLOTS; i++) {
+        for (int j = 0; j < 3; j++)
+            poses[i].pos[j] = uniform(rng);
+        for (int j = 0; j < 4; j++)
+            poses[i].q[j] = uniform(rng);
+        NormalizeQuat(poses[i].q);
+    }
+    uint8_t buffer[8 + MAX_CODEC_SLOTS * 16];
+    double encodeTime = 0.0, decodeTime = 0.0, posError = 0.0, rotError = 0.0;
+    long long bytes = 0;
+    int failures = 0;
+    for (int n = 1; n <= CODEC_TEST_FRAMES; n++) {
+        StepPoses(&rng, poses, MAX_CODEC_SLOTS);
+        codecFrame* frame = &history[n % CODEC_HISTORY];
+        const codecFrame* baseline = n > 1 ? &history[(n - 1) % CODEC_HISTORY] : NULL;
+        auto start = std::chrono::steady_clock::now();
+        frame->used = true;
+        frame->seq = (uint16_t)n;
+        frame->slotCount = MAX_CODEC_SLOTS;
+        for (int i = 0; i < MAX_CODEC_SLOTS; i++) {
+            codecPose& slot = frame->slots[i];
+            slot.valid = QuantizePosition(poses[i].pos[0], &slot.pos[0]) &&
+                         QuantizePosition(poses[i].pos[1], &slot.pos[1]) &&
+                         QuantizePosition(poses[i].pos[2], &slot.pos[2]);
+            slot.rot = QuantizeQuat(poses[i].q);
+        }
+        bitWriter w = { buffer, 0, sizeof(buffer), 0, 0 };
+        EncodeFrame(&w, frame, baseline);
+        auto encoded = std::chrono::steady_clock::now();
+        codecFrame decoded;
+        bitReader r = { buffer, w.size, 0, 0, 0, false };
+        bool ok = DecodeFrame(&r, &decoded, peer);
+        float q[4];
+        for (int i = 0; ok && i < decoded.slotCount; i++)
+            DequantizeQuat(decoded.slots[i].rot, q);
+        auto done = std::chrono::steady_clock::now();
+        encodeTime += std::chrono::duration<double>(encoded - start).count();
+        decodeTime += std::chrono::duration<double>(done - encoded).count();
+        bytes += w.size;
+        if (!ok || decoded.slotCount != MAX_CODEC_SLOTS) {
+            failures++;
+            continue;
+        }
+        peer[decoded.seq % CODEC_HISTORY] = decoded;
+        for (int i = 0; i < MAX_CODEC_SLOTS; i++) {
+            const codecPose& slot = decoded.slots[i];
+            if (!slot.valid || memcmp(slot.pos, frame->slots[i].pos, sizeof(slot.pos)) != 0 || slot.rot != frame->slots[i].rot) {
+                failures++;
+                continue;
+            }
+            for (int j = 0; j < 3; j++)
+                posError = fmax(posError, fabs(slot.pos[j] / CODEC_POS_SCALE - poses[i].pos[j]));
+            DequantizeQuat(slot.rot, q);
+            rotError = fmax(rotError, QuatAngle(q, poses[i].q));
+        }
+    }
+    printf("encode %6.2f M frames/s  decode %6.2f M frames/s  %.1f bytes/frame (%d slots)\n",
+           CODEC_TEST_FRAMES / encodeTime / 1e6, CODEC_TEST_FRAMES / decodeTime / 1e6,
+           (double)bytes / CODEC_TEST_FRAMES, MAX_CODEC_SLOTS);
+    printf("max position error %.6f m  max rotation error %.4f deg\n", posError, rotError);
+    if (posError > CODEC_TEST_MAX_POS_ERROR || rotError > CODEC_TEST_MAX_ROT_ERROR) {
+        printf("FAILED: error above %.6f m / %.2f deg\n", CODEC_TEST_MAX_POS_ERROR, CODEC_TEST_MAX_ROT_ERROR);
+        failures++;
+    }
+    return failures;
+}
+
+// Positions out of range must be reported instead of clamped.
+int CheckSaturation() {
+    int16_t value;
+    int failures = 0;
+    if (!QuantizePosition(31.9f, &value) || value != (int16_t)lrintf(31.9f * CODEC_POS_SCALE))
+        failures++;
+    if (QuantizePosition(32.5f, &value) || QuantizePosition(-32.5f, &value) || QuantizePosition(NAN, &value))
+        failures++;
+    if (failures)
+        printf("FAILED: QuantizePosition range check\n");
+    return failures;
+}
+
+// Position mode 3 is never written and must be rejected, not read as unchanged.
+int CheckReservedMode() {
+    static codecFrame history[CODEC_HISTORY];
+    codecFrame* baseline = &history[1];
+    baseline->used = true;
+    baseline->seq = 1;
+    baseline->slotCount = 1;
+    baseline->slots[0].valid = true;
+    uint8_t buffer[16];
+    bitWriter w = { buffer, 0, sizeof(buffer), 0, 0 };
+    WriteBits(&w, CODEC_VERSION, 8);
+    WriteBits(&w, 2, 16);
+    WriteBits(&w, 1, 1);
+    WriteBits(&w, 1, 16);
+    WriteBits(&w, 1, 5);
+    WriteBits(&w, 1, 1);
+    WriteBits(&w, 3, 2);
+    WriteBits(&w, 0, 1);
+    FlushBits(&w);
+    codecFrame frame;
+    bitReader r = { buffer, w.size, 0, 0, 0, false };
+    if (DecodeFrame(&r, &frame, history)) {
+        printf("FAILED: position mode 3 was accepted\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main() {
+    int failures = CheckRoundTrip() + CheckSaturation() + CheckReservedMode();
+    return failures ? 1 : 0;
+}
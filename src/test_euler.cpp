@@ -0,0 +1,72 @@
+// Accuracy and throughput test for the batch euler kernels. Feeds a few million random
+// rotations through every kernel the CPU supports and checks the SIMD ones against
+// EulerBatchScalar. Built and run by
+//
+//     ./build.sh test
+
+#include "vrmod.cpp"
+#include <random>
+
+#define EULER_TEST_ROTATIONS    (4 << 20)
+#define EULER_TEST_MAX_ERROR    0.001f  // degrees
+
+// Fills the batch inputs from uniformly distributed random rotations, the same way
+// ConvertPoses does from a pose matrix.
+void RandomRotations(std::mt19937* rng, eulerBatch* b, int count) {
+    std::normal_distribution<float> normal;
+    for (int i = 0; i < count; i++) {
+        float x = normal(*rng), y = normal(*rng), z = normal(*rng), w = normal(*rng);
+        float len = sqrtf(x * x + y * y + z * z + w * w);
+        x /= len; y /= len; z /= len; w /= len;
+        b->sinPitch[i] = 2.0f * (y * z - w * x);
+        b->yawY[i] = 2.0f * (x * z + w * y);
+        b->yawX[i] = 1.0f - 2.0f * (x * x + y * y);
+        b->rollY[i] = -2.0f * (x * y + w * z);
+        b->rollX[i] = 1.0f - 2.0f * (x * x + z * z);
+    }
+}
+
+float AngleError(float a, float b) {
+    float d = fabsf(a - b);
+    return d > 180.0f ? 360.0f - d : d;
+}
+
+// Returns the largest error against the scalar kernel and prints the throughput.
+float TestKernel(const char* name, EulerBatchFn fn) {
+    static eulerBatch batch, reference;
+    std::mt19937 rng(1234);
+    float maxError = 0.0f;
+    double seconds = 0.0;
+    for (int done = 0; done < EULER_TEST_ROTATIONS; done += POSE_BATCH_MAX) {
+        RandomRotations(&rng, &batch, POSE_BATCH_MAX);
+        memcpy(&reference, &batch, sizeof(batch));
+        EulerBatchScalar(&reference, POSE_BATCH_MAX);
+        auto start = std::chrono::steady_clock::now();
+        fn(&batch, POSE_BATCH_MAX);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for (int i = 0; i < (int)POSE_BATCH_MAX; i++) {
+            maxError = fmaxf(maxError, AngleError(batch.pitch[i], reference.pitch[i]));
+            maxError = fmaxf(maxError, AngleError(batch.yaw[i], reference.yaw[i]));
+            maxError = fmaxf(maxError, AngleError(batch.roll[i], reference.roll[i]));
+        }
+    }
+    printf("%-8s %8.1f M rotations/s  max error %.6f deg\n", name, EULER_TEST_ROTATIONS / seconds / 1e6, maxError);
+    return maxError;
+}
+
+int main() {
+    int failures = 0;
+    TestKernel("scalar", EulerBatchScalar);
+#ifdef VRMOD_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2") && TestKernel("sse2", EulerBatchSSE2) > EULER_TEST_MAX_ERROR)
+        failures++;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && TestKernel("avx2", EulerBatchAVX2) > EULER_TEST_MAX_ERROR)
+        failures++;
+#endif
+    if (failures) {
+        printf("FAILED: error above %.4f deg\n", EULER_TEST_MAX_ERROR);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+// Benchmark and sanity test for the full body IK solver behind IKSolve. Solves 1, 8 and
+// 32 avatars per frame with tracked head, hands and feet following a fixed random walk,
+// and checks that every solve is finite, keeps the limb lengths and puts reachable hands
+// on their targets. Built and run by
+//
+//     ./build.sh test
+
+#include "vrmod.cpp"
+#include <random>
+
+#define IK_TEST_FRAMES      20000
+#define IK_TEST_TARGETS     256     // precomputed target sets, cycled through
+#define IK_TEST_TOLERANCE   0.001f  // meters
+
+float BoneDistance(const float a[3][4], const float b[3][4]) {
+    return V3Length(V3(a[0][3] - b[0][3], a[1][3] - b[1][3], a[2][3] - b[2][3]));
+}
+
+float TargetDistance(const float bone[3][4], Vector target) {
+    return V3Length(V3(bone[0][3] - target.x, bone[1][3] - target.y, bone[2][3] - target.z));
+}
+
+void RandomTargets(std::mt19937* rng, ikTargets* targets, int count) {
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    for (int n = 0; n < count; n++) {
+        ikTargets* t = &targets[n];
+        for (int i = 0; i < IKTarget_Max; i++) {
+            t->valid[i] = i != IKTarget_Pelvis;
+            float q[4] = { uniform(*rng) * 0.3f, uniform(*rng) * 0.3f, uniform(*rng), 1.0f };
+            float len = sqrtf(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+            for (int j = 0; j < 4; j++)
+                t->quat[i][j] = q[j] / len;
+        }
+        Vector head = V3(uniform(*rng) * 0.1f, uniform(*rng) * 0.1f, 1.65f + uniform(*rng) * 0.05f);
+        t->pos[IKTarget_Head] = head;
+        t->pos[IKTarget_LeftHand] = V3(head.x + 0.3f + uniform(*rng) * 0.3f, head.y + 0.3f + uniform(*rng) * 0.2f, head.z - 0.5f + uniform(*rng) * 0.4f);
+        t->pos[IKTarget_RightHand] = V3(head.x + 0.3f + uniform(*rng) * 0.3f, head.y - 0.3f + uniform(*rng) * 0.2f, head.z - 0.5f + uniform(*rng) * 0.4f);
+        t->pos[IKTarget_LeftFoot] = V3(uniform(*rng) * 0.1f, 0.12f, 0.08f);
+        t->pos[IKTarget_RightFoot] = V3(uniform(*rng) * 0.1f, -0.12f, 0.08f);
+    }
+}
+
+// Returns the number of failed checks in one solved skeleton.
+int CheckSkeleton(const ikRig* rig, const ikTargets* t, float bones[IKBone_Max][3][4]) {
+    int failures = 0;
+    for (int b = 0; b < IKBone_Max; b++) {
+        for (int i = 0; i < 12; i++)
+            failures += !isfinite(bones[b][i / 4][i % 4]);
+    }
+    for (int side = 0; side < 2; side++) {
+        int upper = side == 0 ? IKBone_LeftUpperArm : IKBone_RightUpperArm;
+        Vector target = t->pos[side == 0 ? IKTarget_LeftHand : IKTarget_RightHand];
+        failures += fabsf(BoneDistance(bones[upper], bones[upper + 1]) - rig->upperArm) > IK_TEST_TOLERANCE;
+        failures += fabsf(BoneDistance(bones[upper + 1], bones[upper + 2]) - rig->foreArm) > IK_TEST_TOLERANCE;
+        if (TargetDistance(bones[upper], target) < (rig->upperArm + rig->foreArm) * 0.99f)
+            failures += TargetDistance(bones[upper + 2], target) > IK_TEST_TOLERANCE;
+        int thigh = side == 0 ? IKBone_LeftThigh : IKBone_RightThigh;
+        failures += fabsf(BoneDistance(bones[thigh], bones[thigh + 1]) - rig->thigh) > IK_TEST_TOLERANCE;
+        failures += fabsf(BoneDistance(bones[thigh + 1], bones[thigh + 2]) - rig->shin) > IK_TEST_TOLERANCE;
+    }
+    return failures;
+}
+
+int main() {
+    // The defaults IKRegisterRig uses for an empty rig table.
+    ikRig rig = ikRig();
+    rig.used = true;
+    rig.spineCount = 3;
+    rig.spine[0] = rig.spine[1] = rig.spine[2] = 0.17f;
+    rig.upperArm = 0.3f;
+    rig.foreArm = 0.27f;
+    rig.thigh = 0.45f;
+    rig.shin = 0.43f;
+    rig.headToNeck = V3(-0.08f, 0.0f, -0.12f);
+    rig.shoulderOffset = V3(0.0f, 0.18f, -0.05f);
+    rig.hipOffset = V3(0.0f, 0.1f, -0.05f);
+
+    static ikTargets targets[IK_TEST_TARGETS];
+    static float bones[32][IKBone_Max][3][4];
+    std::mt19937 rng(1234);
+    RandomTargets(&rng, targets, IK_TEST_TARGETS);
+
+    int failures = 0;
+    for (int i = 0; i < IK_TEST_TARGETS; i++) {
+        SolveRig(&rig, &targets[i], bones[0]);
+        failures += CheckSkeleton(&rig, &targets[i], bones[0]);
+    }
+    static const int avatarCounts[] = { 1, 8, 32 };
+    for (int avatars : avatarCounts) {
+        auto start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < IK_TEST_FRAMES; frame++) {
+            for (int a = 0; a < avatars; a++)
+                SolveRig(&rig, &targets[(frame + a * 7) % IK_TEST_TARGETS], bones[a]);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%2d avatars  %7.2f us/frame  %5.0f ns/avatar\n", avatars,
+               seconds / IK_TEST_FRAMES * 1e6, seconds / IK_TEST_FRAMES / avatars * 1e9);
+    }
+    if (failures) {
+        printf("FAILED: %d checks on %d solves\n", failures, IK_TEST_TARGETS);
+        return 1;
+    }
+    return 0;
+}
@@ -1,10 +1,18 @@
 #include <gmod/Interface.h>
 #include <openvr/openvr.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <stdint.h>
 #include <limits.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <stddef.h>
+#include "vrmod_shm.h"
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -20,12 +28,44 @@
 #include <sys/mman.h>
 #include <dlfcn.h>
 #include <unistd.h>
+#include <fcntl.h>
+#define VK_NO_PROTOTYPES
+#include <vulkan/vulkan_core.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define VRMOD_SIMD_X86
+#include <immintrin.h>
 #endif
 
 #define MAX_STR_LEN     256
 #define MAX_ACTIONS     64
 #define MAX_ACTIONSETS  16
+#define MAX_BONES       31
+#define ACTION_LUAREFS  4
+#define MAX_CODEC_SLOTS 16
+#define MAX_CODEC_PEERS 64
+#define CODEC_HISTORY   32
+#define CODEC_VERSION   1
+#define CODEC_POS_SCALE 1024.0f
+#define CODEC_ROT_BITS  11
+#define MAX_REMOTE_PLAYERS  64
+#define MAX_REMOTE_POSES    8
+#define REMOTE_BUFFER_SIZE  16
+#define HISTORY_TRACKS      (vr::k_unMaxTrackedDeviceCount + MAX_ACTIONS)
+#define MAX_IK_RIGS         64
+#define MAX_IK_SPINE        4
 #define PI_F            3.141592654f
+#define BATTERY_POLL_MS 10000
+#define RECONNECT_RETRY_MS  2000
+#define MAX_ABANDONED_WAITS 8
+#define WAIT_UNLOAD_TIMEOUT 2.0
+#define RENDER_STATE_POLL   0.5
+#define MAX_OVERLAYS        16
+#define REPROJECTION_HISTORY 32
+#define SPECTATOR_PBOS      3
+#define SPECTATOR_MAX_SLOTS 16
+#define POSE_BATCH_MAX  ((vr::k_unMaxTrackedDeviceCount + MAX_ACTIONS + 1 + 7) & ~7)
 
 enum EActionType{
     ActionType_Pose         = 439,
@@ -36,22 +76,96 @@ enum EActionType{
     ActionType_Vibration    = 974,
 };
 
+enum EIKTarget{
+    IKTarget_Head,
+    IKTarget_LeftHand,
+    IKTarget_RightHand,
+    IKTarget_LeftFoot,
+    IKTarget_RightFoot,
+    IKTarget_Pelvis,
+    IKTarget_Max,
+};
+
+enum EIKBone{
+    IKBone_Pelvis,
+    IKBone_Spine1,
+    IKBone_Head = IKBone_Spine1 + MAX_IK_SPINE,
+    IKBone_LeftUpperArm,
+    IKBone_LeftForeArm,
+    IKBone_LeftHand,
+    IKBone_RightUpperArm,
+    IKBone_RightForeArm,
+    IKBone_RightHand,
+    IKBone_LeftThigh,
+    IKBone_LeftCalf,
+    IKBone_LeftFoot,
+    IKBone_RightThigh,
+    IKBone_RightCalf,
+    IKBone_RightFoot,
+    IKBone_Max,
+};
+
+enum EInitState{
+    InitState_None,
+    InitState_Connecting,
+    InitState_RuntimeReady,
+    InitState_Ready,
+    InitState_Failed,
+    InitState_Disconnected,
+};
+
+enum EInitStage{
+    InitStage_Runtime,
+    InitStage_Compositor,
+    InitStage_Devices,
+    InitStage_Graphics,
+    InitStage_Max,
+};
+
 enum ELuaRefIndex{
     LuaRefIndex_EmptyTable,
     LuaRefIndex_PoseTable,
     LuaRefIndex_HmdPose,
     LuaRefIndex_ActionTable,
+    LuaRefIndex_DevicePoseTable,
     LuaRefIndex_Max,
 };
 typedef void (APIENTRYP PFNGLBINDFRAMEBUFFERPROC)(GLenum, GLuint);
 static PFNGLBINDFRAMEBUFFERPROC pglBindFramebuffer = NULL;
 
+typedef struct {
+    bool enabled;
+    bool primed;
+    float minCutoff;
+    float beta;
+    float deadzone;
+    float curve;
+    double lastTime;
+    float value[7];
+    float deriv[7];
+} actionFilter;
+
+typedef struct {
+    bool hasLast;
+    bool lost;
+    double lostTime;
+    double recoverTime;
+    float confidence;
+    float blendConfidence;
+    vr::TrackedDevicePose_t last;
+    vr::TrackedDevicePose_t output;
+    vr::TrackedDevicePose_t blendFrom;
+} trackingState;
+
 typedef struct {
     vr::VRActionHandle_t handle;
     char fullname[MAX_STR_LEN];
-    int luaRefs[2];
+    int luaRefs[ACTION_LUAREFS]; // value, finger curls, finger splays, bones
     char* name;
     int type;
+    int summaryType;
+    float predictionOffset;
+    actionFilter filter;
 } action;
 
 typedef struct {
@@ -59,12 +173,212 @@ typedef struct {
     char name[MAX_STR_LEN];
 } actionSet;
 
+typedef struct {
+    Vector pos;
+    Vector vel;
+    QAngle ang;
+    QAngle angvel;
+    float quat[4];
+    float matrix[3][4];
+} poseData;
+
+// Structure-of-arrays input/output for the batch euler kernels. The inputs are the
+// OpenVR rotation terms that GetPoses used to feed to asinf/atan2f directly.
+typedef struct {
+    alignas(32) float sinPitch[POSE_BATCH_MAX];
+    alignas(32) float yawY[POSE_BATCH_MAX];
+    alignas(32) float yawX[POSE_BATCH_MAX];
+    alignas(32) float rollY[POSE_BATCH_MAX];
+    alignas(32) float rollX[POSE_BATCH_MAX];
+    alignas(32) float pitch[POSE_BATCH_MAX];
+    alignas(32) float yaw[POSE_BATCH_MAX];
+    alignas(32) float roll[POSE_BATCH_MAX];
+} eulerBatch;
+
+typedef void (*EulerBatchFn)(eulerBatch* batch, int count);
+
+typedef struct {
+    bool valid;
+    int16_t pos[3];
+    uint64_t rot;
+} codecPose;
+
+typedef struct {
+    bool used;
+    uint16_t seq;
+    int slotCount;
+    codecPose slots[MAX_CODEC_SLOTS];
+} codecFrame;
+
+typedef struct {
+    bool used;
+    int id;
+    codecFrame history[CODEC_HISTORY];
+} codecPeer;
+
+typedef struct {
+    uint8_t* data;
+    unsigned int size;
+    unsigned int capacity;
+    uint64_t acc;
+    int accBits;
+} bitWriter;
+
+typedef struct {
+    const uint8_t* data;
+    unsigned int size;
+    unsigned int pos;
+    uint64_t acc;
+    int accBits;
+    bool overrun;
+} bitReader;
+
+typedef struct {
+    double time;
+    Vector pos;
+    Vector vel;
+    Vector angvel;
+    float quat[4];
+} remoteSample;
+
+typedef struct {
+    char name[64];
+    int sampleCount;
+    remoteSample samples[REMOTE_BUFFER_SIZE];
+} remotePose;
+
+typedef struct {
+    bool used;
+    int id;
+    int poseCount;
+    remotePose poses[MAX_REMOTE_POSES];
+} remotePlayer;
+
+typedef struct {
+    double time;
+    bool valid;
+    vr::HmdMatrix34_t mat;
+} historySample;
+
+// Ring of the most recent samples for one device (index < k_unMaxTrackedDeviceCount) or
+// pose action, backed by the preallocated g_poseHistoryBuffer.
+typedef struct {
+    historySample* samples;
+    int head;
+    int count;
+} poseHistory;
+
+typedef struct {
+    bool used;
+    int id;
+    int luaRef;
+    int spineCount;
+    float spine[MAX_IK_SPINE];
+    float upperArm;
+    float foreArm;
+    float thigh;
+    float shin;
+    Vector headToNeck;
+    Vector shoulderOffset;
+    Vector hipOffset;
+    char targetNames[IKTarget_Max][64];
+} ikRig;
+
+typedef struct {
+    bool valid[IKTarget_Max];
+    Vector pos[IKTarget_Max];
+    float quat[IKTarget_Max][4];
+} ikTargets;
+
+typedef struct {
+    double waitStart;
+    double waitEnd;
+    double submitTime;
+    float wait;
+    float sleep;
+    float poseToSubmit;
+    float submitToWait;
+    float frameInterval;
+    int frames;
+    int droppedFrames;
+    int misPresented;
+} frameStats;
+
+typedef struct {
+    double time;
+    bool halfRate;
+    float load;
+} reprojectionSwitch;
+
+typedef struct {
+    bool enabled;
+    bool halfRate;
+    float high;
+    float low;
+    int engageFrames;
+    int releaseFrames;
+    float minHold;
+    float load;
+    int overCount;
+    int underCount;
+    double lastSwitch;
+    int switchCount;
+    reprojectionSwitch history[REPROJECTION_HISTORY];
+} reprojectionController;
+
+typedef struct {
+    int stalls;
+    int stalledFrames;
+    double lastStall;
+    double longestStall;
+    double totalStall;
+} watchdogStats;
+
+// Shared with the wait thread, which keeps its own reference so that a thread abandoned
+// while stuck in WaitGetPoses never touches anything else once it comes back.
+typedef struct {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::condition_variable doneCond;
+    bool stop;
+    bool requested;
+    bool busy;
+    vr::IVRCompositor* compositor;
+    vr::EVRCompositorError result;
+    vr::TrackedDevicePose_t poses[vr::k_unMaxTrackedDeviceCount];
+} waitState;
+
+// A wait thread left behind while stuck in WaitGetPoses, joined once the wait returns.
+typedef struct {
+    std::thread thread;
+    std::shared_ptr<waitState> state;
+} abandonedWait;
+
+typedef struct {
+    char path[MAX_STR_LEN];
+    vrmodPoseExport* map;
+    vrmodPoseExport staging;
+} poseExport;
+
+typedef struct {
+    bool connected;
+    bool hasBattery;
+    bool charging;
+    int deviceClass;
+    int role;
+    float battery;
+    char controllerType[MAX_STR_LEN];
+    char serial[MAX_STR_LEN];
+    char model[MAX_STR_LEN];
+} trackedDevice;
+
 vr::IVRSystem*          g_pSystem = NULL;
 vr::IVRInput*           g_pInput = NULL;
 vr::TrackedDevicePose_t g_poses[vr::k_unMaxTrackedDeviceCount];
 actionSet               g_actionSets[MAX_ACTIONSETS];
 int                     g_actionSetCount = 0;
 vr::VRActiveActionSet_t g_activeActionSets[MAX_ACTIONSETS];
+int                     g_activeActionSetIndices[MAX_ACTIONSETS];
 int                     g_activeActionSetCount = 0;
 action                  g_actions[MAX_ACTIONS];
 int                     g_actionCount = 0;
@@ -74,7 +388,88 @@ vr::VRTextureBounds_t   g_textureBoundsRight;
 vr::Texture_t           g_vrTexture;
 int                     g_luaRefs[LuaRefIndex_Max];
 int                     g_luaRefCount = 0;
+int                     g_devicePoseLuaRefs[vr::k_unMaxTrackedDeviceCount];
 char                    g_createTextureOrigBytes[14];
+eulerBatch              g_eulerBatch;
+EulerBatchFn            g_pfnEulerBatch = NULL;
+const char*             g_eulerBatchName = "scalar";
+bool                    g_poseOutputEuler = true;
+bool                    g_poseOutputQuat = false;
+bool                    g_poseOutputMatrix = false;
+bool                    g_poseOutputWorld = false;
+bool                    g_poseNextFrame = false;
+float                   g_displayFrequency = 90.0f;
+float                   g_vsyncToPhotons = 0.0f;
+float                   g_trackingOrigin[3][4] = { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } };
+float                   g_trackingScale = 1.0f;
+vr::TrackedDevicePose_t g_lastPoses[MAX_ACTIONS + 1];
+vr::Compositor_FrameTiming g_frameTiming;
+double                  g_frameTime = 0.0;
+trackingState           g_trackingStates[MAX_ACTIONS + 1];
+float                   g_trackingHoldTime = 0.0f;
+float                   g_trackingBlendTime = 0.2f;
+historySample*          g_poseHistoryBuffer = NULL;
+int                     g_poseHistoryCapacity = 0;
+poseHistory             g_poseHistory[HISTORY_TRACKS];
+codecFrame              g_codecHistory[CODEC_HISTORY];
+uint16_t                g_codecSeq = 0;
+codecPeer               g_codecPeers[MAX_CODEC_PEERS];
+remotePlayer            g_remotePlayers[MAX_REMOTE_PLAYERS];
+float                   g_remoteMaxExtrapolation = 0.1f;
+int                     g_remotePoseLuaRef = 0;
+ikRig                   g_ikRigs[MAX_IK_RIGS];
+trackedDevice           g_devices[vr::k_unMaxTrackedDeviceCount];
+std::mutex              g_deviceMutex;
+std::thread             g_batteryThread;
+std::mutex              g_batteryThreadMutex;
+std::condition_variable g_batteryThreadCond;
+bool                    g_batteryThreadStop = false;
+std::thread             g_initThread;
+std::mutex              g_initMutex;
+EInitState              g_initState = InitState_None;
+vr::IVRSystem*          g_initSystem = NULL;
+char                    g_initError[MAX_STR_LEN];
+double                  g_initStageTimes[InitStage_Max];
+double                  g_initStartTime = 0.0;
+std::condition_variable g_initCond;
+bool                    g_initThreadStop = false;
+bool                    g_reconnecting = false;
+bool                    g_quitPending = false;
+int                     g_reconnectCount = 0;
+char                    g_actionManifestPath[PATH_MAX];
+std::thread             g_waitThread;
+std::shared_ptr<waitState> g_wait;
+abandonedWait           g_abandonedWaits[MAX_ABANDONED_WAITS];
+int                     g_abandonedWaitCount = 0;
+double                  g_waitStartTime = 0.0;
+bool                    g_waitWatchdog = false;
+float                   g_waitDeadlineFrames = 3.0f;
+bool                    g_waitStalled = false;
+watchdogStats           g_watchdogStats;
+double                  g_frameClock = 0.0;
+bool                    g_runningStart = false;
+float                   g_waitLead = 0.0f;
+frameStats              g_frameStats;
+bool                    g_renderSuspension = false;
+float                   g_keepAliveInterval = 0.5f;
+bool                    g_userPresent = true;
+bool                    g_dashboardVisible = false;
+bool                    g_sceneFocus = true;
+bool                    g_renderStateDirty = true;
+double                  g_renderStateTime = 0.0;
+double                  g_keepAliveTime = 0.0;
+reprojectionController  g_reprojection;
+bool                    g_submitDepth = false;
+void*                   g_depthHandle = NULL;
+vr::HmdMatrix44_t       g_eyeProjection[2];
+bool                    g_hasEyeProjection = false;
+bool                    g_loadingMode = false;
+bool                    g_loadingSkybox = false;
+bool                    g_loadingColor = false;
+int                     g_loadingOverlay = 0;
+float                   g_loadingRGB[3];
+float                   g_loadingFade = 0.0f;
+poseExport              g_poseExport;
 
 #ifdef _WIN32
 typedef HRESULT (APIENTRY* CreateTexture)(IDirect3DDevice9*, UINT, UINT, UINT, DWORD, D3DFORMAT, D3DPOOL, IDirect3DTexture9**, HANDLE*);
@@ -82,13 +477,16 @@ CreateTexture           g_createTexture = NULL;
 ID3D11Device*           g_d3d11Device = NULL;
 ID3D11Texture2D*        g_d3d11Texture = NULL;
 HANDLE                  g_sharedTexture = NULL;
+HANDLE                  g_sharedDepthTexture = NULL;
+ID3D11Texture2D*        g_d3d11DepthTexture = NULL;
+HANDLE*                 g_captureTexture = &g_sharedTexture;
 IDirect3DDevice9*       g_pD3D9Device = NULL;
 typedef void*           (*CreateInterfaceFn)(const char* pName, int* pReturnCode);
 
 HRESULT APIENTRY CreateTextureHook(IDirect3DDevice9* pDevice, UINT w, UINT h, UINT levels, DWORD usage, D3DFORMAT format, D3DPOOL pool, IDirect3DTexture9** tex, HANDLE* shared_handle) {
     WriteProcessMemory(GetCurrentProcess(), g_createTexture, g_createTextureOrigBytes, 14, NULL);
-    if (g_sharedTexture == NULL) {
-        shared_handle = &g_sharedTexture;
+    if (*g_captureTexture == NULL) {
+        shared_handle = g_captureTexture;
         pool = D3DPOOL_DEFAULT;
     }
     return g_createTexture(pDevice, w, h, levels, usage, format, pool, tex, shared_handle);
@@ -114,14 +512,580 @@ typedef void (*glGenTextures_t)(GLsizei n, GLuint *textures);
 
 void*                   g_createTexture = NULL;
 GLuint                  g_sharedTexture = GL_INVALID_VALUE;
+GLuint                  g_sharedDepthTexture = GL_INVALID_VALUE;
+GLuint*                 g_captureTexture = &g_sharedTexture;
 COpenGLEntryPoints*     g_GL = NULL;
 
 void CreateTextureHook(GLsizei n, GLuint *textures) {
     memcpy((void*)g_createTexture, (void*)g_createTextureOrigBytes, 14);
     ((glGenTextures_t)g_createTexture)(n, textures);
-    g_sharedTexture = textures[0];
+    *g_captureTexture = textures[0];
+}
+
+// libvulkan is loaded at runtime so the module still loads on systems without it.
+static PFN_vkGetInstanceProcAddr                    pvkGetInstanceProcAddr = NULL;
+static PFN_vkCreateInstance                         pvkCreateInstance = NULL;
+static PFN_vkDestroyInstance                        pvkDestroyInstance = NULL;
+static PFN_vkEnumeratePhysicalDevices               pvkEnumeratePhysicalDevices = NULL;
+static PFN_vkGetPhysicalDeviceProperties2           pvkGetPhysicalDeviceProperties2 = NULL;
+static PFN_vkGetPhysicalDeviceQueueFamilyProperties pvkGetPhysicalDeviceQueueFamilyProperties = NULL;
+static PFN_vkGetPhysicalDeviceMemoryProperties      pvkGetPhysicalDeviceMemoryProperties = NULL;
+static PFN_vkCreateDevice                           pvkCreateDevice = NULL;
+static PFN_vkDestroyDevice                          pvkDestroyDevice = NULL;
+static PFN_vkGetDeviceQueue                         pvkGetDeviceQueue = NULL;
+static PFN_vkCreateImage                            pvkCreateImage = NULL;
+static PFN_vkDestroyImage                           pvkDestroyImage = NULL;
+static PFN_vkGetImageMemoryRequirements             pvkGetImageMemoryRequirements = NULL;
+static PFN_vkAllocateMemory                         pvkAllocateMemory = NULL;
+static PFN_vkFreeMemory                             pvkFreeMemory = NULL;
+static PFN_vkBindImageMemory                        pvkBindImageMemory = NULL;
+static PFN_vkGetMemoryFdKHR                         pvkGetMemoryFdKHR = NULL;
+static PFN_vkCreateSemaphore                        pvkCreateSemaphore = NULL;
+static PFN_vkDestroySemaphore                       pvkDestroySemaphore = NULL;
+static PFN_vkGetSemaphoreFdKHR                      pvkGetSemaphoreFdKHR = NULL;
+static PFN_vkQueueSubmit                            pvkQueueSubmit = NULL;
+static PFN_vkDeviceWaitIdle                         pvkDeviceWaitIdle = NULL;
+static PFNGLGETSTRINGIPROC                          pglGetStringi = NULL;
+static PFNGLGETUNSIGNEDBYTEVEXTPROC                 pglGetUnsignedBytevEXT = NULL;
+static PFNGLGETUNSIGNEDBYTEI_VEXTPROC               pglGetUnsignedBytei_vEXT = NULL;
+static PFNGLCREATEMEMORYOBJECTSEXTPROC              pglCreateMemoryObjectsEXT = NULL;
+static PFNGLDELETEMEMORYOBJECTSEXTPROC              pglDeleteMemoryObjectsEXT = NULL;
+static PFNGLMEMORYOBJECTPARAMETERIVEXTPROC          pglMemoryObjectParameterivEXT = NULL;
+static PFNGLIMPORTMEMORYFDEXTPROC                   pglImportMemoryFdEXT = NULL;
+static PFNGLTEXSTORAGEMEM2DEXTPROC                  pglTexStorageMem2DEXT = NULL;
+static PFNGLGENSEMAPHORESEXTPROC                    pglGenSemaphoresEXT = NULL;
+static PFNGLDELETESEMAPHORESEXTPROC                 pglDeleteSemaphoresEXT = NULL;
+static PFNGLIMPORTSEMAPHOREFDEXTPROC                pglImportSemaphoreFdEXT = NULL;
+static PFNGLSIGNALSEMAPHOREEXTPROC                  pglSignalSemaphoreEXT = NULL;
+static PFNGLWAITSEMAPHOREEXTPROC                    pglWaitSemaphoreEXT = NULL;
+
+// The shared texture's storage is moved into exported Vulkan memory so the compositor can
+// read the game's render target directly as a VkImage.
+typedef struct {
+    bool enabled;
+    void* lib;
+    VkInstance instance;
+    VkPhysicalDevice physicalDevice;
+    VkDevice device;
+    VkQueue queue;
+    VkImage image;
+    VkDeviceMemory memory;
+    VkSemaphore renderDone;     // signalled by GL once the frame is drawn
+    VkSemaphore readDone;       // signalled after the compositor has copied the frame
+    GLuint glMemory;
+    GLuint glRenderDone;
+    GLuint glReadDone;
+    vr::VRVulkanTextureData_t data;
+    vr::Texture_t texture;
+} vulkanSubmit;
+
+vulkanSubmit            g_vulkan;
+
+static PFNGLGENFRAMEBUFFERSPROC                     pglGenFramebuffers = NULL;
+static PFNGLDELETEFRAMEBUFFERSPROC                  pglDeleteFramebuffers = NULL;
+static PFNGLFRAMEBUFFERTEXTURE2DPROC                pglFramebufferTexture2D = NULL;
+static PFNGLBLITFRAMEBUFFERPROC                     pglBlitFramebuffer = NULL;
+static PFNGLGENBUFFERSPROC                          pglGenBuffers = NULL;
+static PFNGLDELETEBUFFERSPROC                       pglDeleteBuffers = NULL;
+static PFNGLBINDBUFFERPROC                          pglBindBuffer = NULL;
+static PFNGLBUFFERDATAPROC                          pglBufferData = NULL;
+static PFNGLMAPBUFFERRANGEPROC                      pglMapBufferRange = NULL;
+static PFNGLUNMAPBUFFERPROC                         pglUnmapBuffer = NULL;
+static PFNGLFENCESYNCPROC                           pglFenceSync = NULL;
+static PFNGLCLIENTWAITSYNCPROC                      pglClientWaitSync = NULL;
+static PFNGLDELETESYNCPROC                          pglDeleteSync = NULL;
+
+// Eye regions of the shared texture are scaled into a small texture, read back into a
+// rotating set of PBOs and published to a /dev/shm ring once their fence has passed, so
+// the game never waits on the readback.
+typedef struct {
+    bool enabled;
+    int eyes;               // bit 0 left, bit 1 right
+    int downscale;
+    int frameSkip;
+    int frameCounter;
+    int textureWidth;
+    int textureHeight;
+    int width;
+    int height;
+    int next;               // PBO the next capture goes into
+    int pending;            // oldest PBO still in flight
+    GLuint fbo[2];          // reads the shared texture, draws the scaled copy
+    GLuint texture;
+    GLuint pbo[SPECTATOR_PBOS];
+    GLsync fence[SPECTATOR_PBOS];
+    double submitTime[SPECTATOR_PBOS];
+    char path[MAX_STR_LEN];
+    uint8_t* map;
+    size_t mapSize;
+    uint64_t captured;
+    uint64_t published;
+    uint64_t dropped;
+    float latency;
+} spectatorStream;
+
+spectatorStream         g_spectator;
+#endif
+
+typedef struct {
+    bool used;
+    bool visible;
+    bool hasTexture;
+    vr::VROverlayHandle_t handle;
+    char key[MAX_STR_LEN];
+    char name[MAX_STR_LEN];
+    float width;
+    vr::TrackedDeviceIndex_t device;
+    vr::HmdMatrix34_t transform;
+    vr::VRTextureBounds_t bounds;
+    vr::Texture_t texture;
+#ifdef _WIN32
+    HANDLE sharedTexture;
+    ID3D11Texture2D* d3d11Texture;
+#else
+    GLuint sharedTexture;
+#endif
+} vrOverlay;
+
+vrOverlay               g_overlays[MAX_OVERLAYS];
+
+// Pose conversion kernels. The SIMD versions use cephes style asin and a minimax
+// atan polynomial; measured max error against asinf/atan2f is below 0.001 degrees.
+
+void EulerBatchScalar(eulerBatch* b, int count) {
+    for (int i = 0; i < count; i++) {
+        b->pitch[i] = asinf(b->sinPitch[i]) * (180.0f / PI_F);
+        b->yaw[i] = atan2f(b->yawY[i], b->yawX[i]) * (180.0f / PI_F);
+        b->roll[i] = atan2f(b->rollY[i], b->rollX[i]) * (180.0f / PI_F);
+    }
+}
+
+#ifdef VRMOD_SIMD_X86
+__attribute__((target("sse2"))) static inline __m128 Asin4(__m128 x) {
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    __m128 sign = _mm_and_ps(x, signMask);
+    __m128 a = _mm_min_ps(_mm_andnot_ps(signMask, x), _mm_set1_ps(1.0f));
+    __m128 big = _mm_cmpgt_ps(a, half);
+    __m128 zBig = _mm_mul_ps(half, _mm_sub_ps(_mm_set1_ps(1.0f), a));
+    __m128 z = _mm_or_ps(_mm_and_ps(big, zBig), _mm_andnot_ps(big, _mm_mul_ps(a, a)));
+    __m128 v = _mm_or_ps(_mm_and_ps(big, _mm_sqrt_ps(zBig)), _mm_andnot_ps(big, a));
+    __m128 p = _mm_set1_ps(4.2163199048e-2f);
+    p = _mm_add_ps(_mm_mul_ps(p, z), _mm_set1_ps(2.4181311049e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, z), _mm_set1_ps(4.5470025998e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, z), _mm_set1_ps(7.4953002686e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, z), _mm_set1_ps(1.6666752422e-1f));
+    __m128 r = _mm_add_ps(v, _mm_mul_ps(_mm_mul_ps(v, z), p));
+    __m128 rBig = _mm_sub_ps(_mm_set1_ps(PI_F * 0.5f), _mm_add_ps(r, r));
+    r = _mm_or_ps(_mm_and_ps(big, rBig), _mm_andnot_ps(big, r));
+    return _mm_or_ps(r, sign);
+}
+
+__attribute__((target("sse2"))) static inline __m128 Atan2_4(__m128 y, __m128 x) {
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 ax = _mm_andnot_ps(signMask, x);
+    __m128 ay = _mm_andnot_ps(signMask, y);
+    __m128 mx = _mm_max_ps(_mm_max_ps(ax, ay), _mm_set1_ps(1e-30f));
+    __m128 a = _mm_div_ps(_mm_min_ps(ax, ay), mx);
+    __m128 s = _mm_mul_ps(a, a);
+    __m128 p = _mm_set1_ps(-0.01172120f);
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(0.05265332f));
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(-0.11643287f));
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(0.19354346f));
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(-0.33262347f));
+    p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(0.99997726f));
+    __m128 r = _mm_mul_ps(a, p);
+    __m128 swap = _mm_cmpgt_ps(ay, ax);
+    r = _mm_or_ps(_mm_and_ps(swap, _mm_sub_ps(_mm_set1_ps(PI_F * 0.5f), r)), _mm_andnot_ps(swap, r));
+    __m128 neg = _mm_cmplt_ps(x, _mm_setzero_ps());
+    r = _mm_or_ps(_mm_and_ps(neg, _mm_sub_ps(_mm_set1_ps(PI_F), r)), _mm_andnot_ps(neg, r));
+    return _mm_or_ps(r, _mm_and_ps(y, signMask));
+}
+
+__attribute__((target("sse2"))) void EulerBatchSSE2(eulerBatch* b, int count) {
+    const __m128 toDeg = _mm_set1_ps(180.0f / PI_F);
+    for (int i = 0; i < count; i += 4) {
+        _mm_store_ps(b->pitch + i, _mm_mul_ps(Asin4(_mm_load_ps(b->sinPitch + i)), toDeg));
+        _mm_store_ps(b->yaw + i, _mm_mul_ps(Atan2_4(_mm_load_ps(b->yawY + i), _mm_load_ps(b->yawX + i)), toDeg));
+        _mm_store_ps(b->roll + i, _mm_mul_ps(Atan2_4(_mm_load_ps(b->rollY + i), _mm_load_ps(b->rollX + i)), toDeg));
+    }
+}
+
+__attribute__((target("avx2,fma"))) static inline __m256 Asin8(__m256 x) {
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    __m256 sign = _mm256_and_ps(x, signMask);
+    __m256 a = _mm256_min_ps(_mm256_andnot_ps(signMask, x), _mm256_set1_ps(1.0f));
+    __m256 big = _mm256_cmp_ps(a, half, _CMP_GT_OQ);
+    __m256 zBig = _mm256_mul_ps(half, _mm256_sub_ps(_mm256_set1_ps(1.0f), a));
+    __m256 z = _mm256_blendv_ps(_mm256_mul_ps(a, a), zBig, big);
+    __m256 v = _mm256_blendv_ps(a, _mm256_sqrt_ps(zBig), big);
+    __m256 p = _mm256_set1_ps(4.2163199048e-2f);
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(2.4181311049e-2f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(4.5470025998e-2f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(7.4953002686e-2f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(1.6666752422e-1f));
+    __m256 r = _mm256_fmadd_ps(_mm256_mul_ps(v, z), p, v);
+    r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(PI_F * 0.5f), _mm256_add_ps(r, r)), big);
+    return _mm256_or_ps(r, sign);
 }
+
+__attribute__((target("avx2,fma"))) static inline __m256 Atan2_8(__m256 y, __m256 x) {
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    __m256 ax = _mm256_andnot_ps(signMask, x);
+    __m256 ay = _mm256_andnot_ps(signMask, y);
+    __m256 mx = _mm256_max_ps(_mm256_max_ps(ax, ay), _mm256_set1_ps(1e-30f));
+    __m256 a = _mm256_div_ps(_mm256_min_ps(ax, ay), mx);
+    __m256 s = _mm256_mul_ps(a, a);
+    __m256 p = _mm256_set1_ps(-0.01172120f);
+    p = _mm256_fmadd_ps(p, s, _mm256_set1_ps(0.05265332f));
+    p = _mm256_fmadd_ps(p, s, _mm256_set1_ps(-0.11643287f));
+    p = _mm256_fmadd_ps(p, s, _mm256_set1_ps(0.19354346f));
+    p = _mm256_fmadd_ps(p, s, _mm256_set1_ps(-0.33262347f));
+    p = _mm256_fmadd_ps(p, s, _mm256_set1_ps(0.99997726f));
+    __m256 r = _mm256_mul_ps(a, p);
+    r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(PI_F * 0.5f), r), _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+    r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(PI_F), r), _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ));
+    return _mm256_or_ps(r, _mm256_and_ps(y, signMask));
+}
+
+__attribute__((target("avx2,fma"))) void EulerBatchAVX2(eulerBatch* b, int count) {
+    const __m256 toDeg = _mm256_set1_ps(180.0f / PI_F);
+    for (int i = 0; i < count; i += 8) {
+        _mm256_store_ps(b->pitch + i, _mm256_mul_ps(Asin8(_mm256_load_ps(b->sinPitch + i)), toDeg));
+        _mm256_store_ps(b->yaw + i, _mm256_mul_ps(Atan2_8(_mm256_load_ps(b->yawY + i), _mm256_load_ps(b->yawX + i)), toDeg));
+        _mm256_store_ps(b->roll + i, _mm256_mul_ps(Atan2_8(_mm256_load_ps(b->rollY + i), _mm256_load_ps(b->rollX + i)), toDeg));
+    }
+}
+#endif
+
+void SelectEulerBatch() {
+    g_pfnEulerBatch = EulerBatchScalar;
+    g_eulerBatchName = "scalar";
+#ifdef VRMOD_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        g_pfnEulerBatch = EulerBatchAVX2;
+        g_eulerBatchName = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        g_pfnEulerBatch = EulerBatchSSE2;
+        g_eulerBatchName = "sse2";
+    }
 #endif
+}
+
+// Source space rotation/translation from an OpenVR pose matrix: source x = -vr z,
+// source y = -vr x, source z = vr y.
+void PoseToSourceMatrix(const vr::HmdMatrix34_t& mat, float out[3][4]) {
+    static const int axis[3] = { 2, 0, 1 };
+    static const float sign[3] = { -1.0f, -1.0f, 1.0f };
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++)
+            out[i][j] = sign[i] * sign[j] * mat.m[axis[i]][axis[j]];
+        out[i][3] = sign[i] * mat.m[axis[i]][3];
+    }
+}
+
+// Inverse of PoseToSourceMatrix: vr x = -source y, vr y = source z, vr z = -source x.
+void SourceToPoseMatrix(const float in[3][4], vr::HmdMatrix34_t* mat) {
+    static const int axis[3] = { 1, 2, 0 };
+    static const float sign[3] = { -1.0f, 1.0f, -1.0f };
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++)
+            mat->m[i][j] = sign[i] * sign[j] * in[axis[i]][axis[j]];
+        mat->m[i][3] = sign[i] * in[axis[i]][3];
+    }
+}
+
+// Quaternion (x, y, z, w) from a rotation matrix without trig.
+void MatrixToQuat(const float m[3][4], float q[4]) {
+    float trace = m[0][0] + m[1][1] + m[2][2];
+    if (trace > 0.0f) {
+        float s = sqrtf(trace + 1.0f) * 2.0f;
+        q[3] = 0.25f * s;
+        q[0] = (m[2][1] - m[1][2]) / s;
+        q[1] = (m[0][2] - m[2][0]) / s;
+        q[2] = (m[1][0] - m[0][1]) / s;
+    }
+    else if (m[0][0] > m[1][1] && m[0][0] > m[2][2]) {
+        float s = sqrtf(1.0f + m[0][0] - m[1][1] - m[2][2]) * 2.0f;
+        q[3] = (m[2][1] - m[1][2]) / s;
+        q[0] = 0.25f * s;
+        q[1] = (m[0][1] + m[1][0]) / s;
+        q[2] = (m[0][2] + m[2][0]) / s;
+    }
+    else if (m[1][1] > m[2][2]) {
+        float s = sqrtf(1.0f + m[1][1] - m[0][0] - m[2][2]) * 2.0f;
+        q[3] = (m[0][2] - m[2][0]) / s;
+        q[0] = (m[0][1] + m[1][0]) / s;
+        q[1] = 0.25f * s;
+        q[2] = (m[1][2] + m[2][1]) / s;
+    }
+    else {
+        float s = sqrtf(1.0f + m[2][2] - m[0][0] - m[1][1]) * 2.0f;
+        q[3] = (m[1][0] - m[0][1]) / s;
+        q[0] = (m[0][2] + m[2][0]) / s;
+        q[1] = (m[1][2] + m[2][1]) / s;
+        q[2] = 0.25f * s;
+    }
+}
+
+// Quaternion (x, y, z, w) from Source euler angles in degrees, as in mathlib AngleQuaternion.
+void AngleToQuat(const QAngle& ang, float q[4]) {
+    float sp = sinf(ang.x * (PI_F / 360.0f)), cp = cosf(ang.x * (PI_F / 360.0f));
+    float sy = sinf(ang.y * (PI_F / 360.0f)), cy = cosf(ang.y * (PI_F / 360.0f));
+    float sr = sinf(ang.z * (PI_F / 360.0f)), cr = cosf(ang.z * (PI_F / 360.0f));
+    q[0] = sr * cp * cy - cr * sp * sy;
+    q[1] = cr * sp * cy + sr * cp * sy;
+    q[2] = cr * cp * sy - sr * sp * cy;
+    q[3] = cr * cp * cy + sr * sp * sy;
+}
+
+void QuatToAngle(const float q[4], QAngle& ang) {
+    float fwdZ = 2.0f * (q[0] * q[2] - q[3] * q[1]);
+    ang.x = -asinf(fwdZ < -1.0f ? -1.0f : (fwdZ > 1.0f ? 1.0f : fwdZ)) * (180.0f / PI_F);
+    ang.y = atan2f(2.0f * (q[0] * q[1] + q[3] * q[2]), 1.0f - 2.0f * (q[1] * q[1] + q[2] * q[2])) * (180.0f / PI_F);
+    ang.z = atan2f(2.0f * (q[1] * q[2] + q[3] * q[0]), 1.0f - 2.0f * (q[0] * q[0] + q[1] * q[1])) * (180.0f / PI_F);
+}
+
+void QuatSlerp(const float a[4], const float b[4], float t, float out[4]) {
+    float dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+    float sign = dot < 0.0f ? -1.0f : 1.0f;
+    dot *= sign;
+    float wa = 1.0f - t, wb = t;
+    if (dot < 0.9995f) {
+        float theta = acosf(dot);
+        float sinTheta = sinf(theta);
+        wa = sinf(wa * theta) / sinTheta;
+        wb = sinf(wb * theta) / sinTheta;
+    }
+    float len = 0.0f;
+    for (int i = 0; i < 4; i++) {
+        out[i] = a[i] * wa + b[i] * wb * sign;
+        len += out[i] * out[i];
+    }
+    len = 1.0f / sqrtf(len);
+    for (int i = 0; i < 4; i++)
+        out[i] *= len;
+}
+
+// Rotates q by a world space angular velocity (degrees per second) over dt seconds.
+void QuatIntegrate(const float q[4], const Vector& angvel, float dt, float out[4]) {
+    float ax = angvel.x * (PI_F / 180.0f), ay = angvel.y * (PI_F / 180.0f), az = angvel.z * (PI_F / 180.0f);
+    float speed = sqrtf(ax * ax + ay * ay + az * az);
+    if (speed * dt < 1e-6f) {
+        memcpy(out, q, sizeof(float) * 4);
+        return;
+    }
+    float s = sinf(speed * dt * 0.5f) / speed;
+    float r[4] = { ax * s, ay * s, az * s, cosf(speed * dt * 0.5f) };
+    out[0] = r[3] * q[0] + r[0] * q[3] + r[1] * q[2] - r[2] * q[1];
+    out[1] = r[3] * q[1] - r[0] * q[2] + r[1] * q[3] + r[2] * q[0];
+    out[2] = r[3] * q[2] + r[0] * q[1] - r[1] * q[0] + r[2] * q[3];
+    out[3] = r[3] * q[3] - r[0] * q[0] - r[1] * q[1] - r[2] * q[2];
+}
+
+void QuatToMatrix(const float q[4], float m[3][4]) {
+    float x = q[0], y = q[1], z = q[2], w = q[3];
+    m[0][0] = 1.0f - 2.0f * (y * y + z * z);
+    m[0][1] = 2.0f * (x * y - w * z);
+    m[0][2] = 2.0f * (x * z + w * y);
+    m[1][0] = 2.0f * (x * y + w * z);
+    m[1][1] = 1.0f - 2.0f * (x * x + z * z);
+    m[1][2] = 2.0f * (y * z - w * x);
+    m[2][0] = 2.0f * (x * z - w * y);
+    m[2][1] = 2.0f * (y * z + w * x);
+    m[2][2] = 1.0f - 2.0f * (x * x + y * y);
+}
+
+// Applies the tracking origin (OpenVR axes) to a tracking space pose matrix.
+void TransformToWorld(const vr::HmdMatrix34_t& mat, vr::HmdMatrix34_t* out) {
+    const float (*o)[4] = g_trackingOrigin;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++)
+            out->m[i][j] = o[i][0] * mat.m[0][j] + o[i][1] * mat.m[1][j] + o[i][2] * mat.m[2][j];
+        out->m[i][3] = (o[i][0] * mat.m[0][3] + o[i][1] * mat.m[1][3] + o[i][2] * mat.m[2][3]) * g_trackingScale + o[i][3];
+    }
+}
+
+void RotateToWorld(const vr::HmdVector3_t& v, float scale, vr::HmdVector3_t* out) {
+    const float (*o)[4] = g_trackingOrigin;
+    for (int i = 0; i < 3; i++)
+        out->v[i] = (o[i][0] * v.v[0] + o[i][1] * v.v[1] + o[i][2] * v.v[2]) * scale;
+}
+
+// Converts count OpenVR poses into Source space in one pass. Euler angles for all poses
+// are computed together by the dispatched batch kernel, and skipped entirely when only
+// quaternion or matrix output is enabled.
+void ConvertPoses(const vr::TrackedDevicePose_t* const* poses, poseData* out, int count) {
+    eulerBatch* b = &g_eulerBatch;
+    vr::HmdMatrix34_t worldMats[POSE_BATCH_MAX];
+    const vr::HmdMatrix34_t* mats[POSE_BATCH_MAX];
+    for (int i = 0; i < count; i++) {
+        mats[i] = &poses[i]->mDeviceToAbsoluteTracking;
+        if (g_poseOutputWorld) {
+            TransformToWorld(*mats[i], &worldMats[i]);
+            mats[i] = &worldMats[i];
+        }
+    }
+    if (g_poseOutputEuler) {
+        for (int i = 0; i < count; i++) {
+            const vr::HmdMatrix34_t& mat = *mats[i];
+            b->sinPitch[i] = mat.m[1][2];
+            b->yawY[i] = mat.m[0][2];
+            b->yawX[i] = mat.m[2][2];
+            b->rollY[i] = -mat.m[1][0];
+            b->rollX[i] = mat.m[1][1];
+        }
+        int padded = (count + 7) & ~7;
+        for (int i = count; i < padded; i++) {
+            b->sinPitch[i] = b->yawY[i] = b->rollY[i] = 0.0f;
+            b->yawX[i] = b->rollX[i] = 1.0f;
+        }
+        g_pfnEulerBatch(b, padded);
+    }
+    for (int i = 0; i < count; i++) {
+        const vr::HmdMatrix34_t& mat = *mats[i];
+        vr::HmdVector3_t vel = poses[i]->vVelocity;
+        vr::HmdVector3_t angvel = poses[i]->vAngularVelocity;
+        if (g_poseOutputWorld) {
+            RotateToWorld(poses[i]->vVelocity, g_trackingScale, &vel);
+            RotateToWorld(poses[i]->vAngularVelocity, 1.0f, &angvel);
+        }
+        out[i].pos.x = -mat.m[2][3];
+        out[i].pos.y = -mat.m[0][3];
+        out[i].pos.z = mat.m[1][3];
+        if (g_poseOutputEuler) {
+            out[i].ang.x = b->pitch[i];
+            out[i].ang.y = b->yaw[i];
+            out[i].ang.z = b->roll[i];
+        }
+        if (g_poseOutputQuat || g_poseOutputMatrix)
+            PoseToSourceMatrix(mat, out[i].matrix);
+        if (g_poseOutputQuat)
+            MatrixToQuat(out[i].matrix, out[i].quat);
+        out[i].vel.x = -vel.v[2];
+        out[i].vel.y = -vel.v[0];
+        out[i].vel.z = vel.v[1];
+        out[i].angvel.x = -angvel.v[2] * (180.0f / PI_F);
+        out[i].angvel.y = -angvel.v[0] * (180.0f / PI_F);
+        out[i].angvel.z = angvel.v[1] * (180.0f / PI_F);
+    }
+}
+
+void RefreshDeviceBattery(vr::TrackedDeviceIndex_t index) {
+    vr::ETrackedPropertyError err = vr::TrackedProp_Success;
+    bool hasBattery = g_pSystem->GetBoolTrackedDeviceProperty(index, vr::Prop_DeviceProvidesBatteryStatus_Bool, &err) && err == vr::TrackedProp_Success;
+    float battery = hasBattery ? g_pSystem->GetFloatTrackedDeviceProperty(index, vr::Prop_DeviceBatteryPercentage_Float) : 0.0f;
+    bool charging = hasBattery && g_pSystem->GetBoolTrackedDeviceProperty(index, vr::Prop_DeviceIsCharging_Bool);
+    std::lock_guard<std::mutex> lock(g_deviceMutex);
+    g_devices[index].hasBattery = hasBattery;
+    g_devices[index].battery = battery;
+    g_devices[index].charging = charging;
+}
+
+void RefreshDevice(vr::TrackedDeviceIndex_t index) {
+    trackedDevice device;
+    memset(&device, 0, sizeof(device));
+    device.connected = g_pSystem->IsTrackedDeviceConnected(index);
+    if (device.connected) {
+        device.deviceClass = g_pSystem->GetTrackedDeviceClass(index);
+        device.role = g_pSystem->GetControllerRoleForTrackedDeviceIndex(index);
+        g_pSystem->GetStringTrackedDeviceProperty(index, vr::Prop_ControllerType_String, device.controllerType, MAX_STR_LEN);
+        g_pSystem->GetStringTrackedDeviceProperty(index, vr::Prop_SerialNumber_String, device.serial, MAX_STR_LEN);
+        g_pSystem->GetStringTrackedDeviceProperty(index, vr::Prop_ModelNumber_String, device.model, MAX_STR_LEN);
+        if (index == vr::k_unTrackedDeviceIndex_Hmd) {
+            float frequency = g_pSystem->GetFloatTrackedDeviceProperty(index, vr::Prop_DisplayFrequency_Float);
+            if (frequency > 0.0f)
+                g_displayFrequency = frequency;
+            g_vsyncToPhotons = g_pSystem->GetFloatTrackedDeviceProperty(index, vr::Prop_SecondsFromVsyncToPhotons_Float);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_deviceMutex);
+        g_devices[index] = device;
+    }
+    if (device.connected)
+        RefreshDeviceBattery(index);
+}
+
+void BatteryThreadMain() {
+    std::unique_lock<std::mutex> lock(g_batteryThreadMutex);
+    while (!g_batteryThreadCond.wait_for(lock, std::chrono::milliseconds(BATTERY_POLL_MS), [] { return g_batteryThreadStop; })) {
+        for (vr::TrackedDeviceIndex_t i = 0; i < vr::k_unMaxTrackedDeviceCount; i++) {
+            bool connected;
+            {
+                std::lock_guard<std::mutex> deviceLock(g_deviceMutex);
+                connected = g_devices[i].connected;
+            }
+            if (connected)
+                RefreshDeviceBattery(i);
+        }
+    }
+}
+
+void StartDeviceCache() {
+    for (vr::TrackedDeviceIndex_t i = 0; i < vr::k_unMaxTrackedDeviceCount; i++)
+        RefreshDevice(i);
+    g_batteryThreadStop = false;
+    g_batteryThread = std::thread(BatteryThreadMain);
+}
+
+void StopDeviceCache() {
+    if (g_batteryThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(g_batteryThreadMutex);
+            g_batteryThreadStop = true;
+        }
+        g_batteryThreadCond.notify_all();
+        g_batteryThread.join();
+    }
+    std::lock_guard<std::mutex> lock(g_deviceMutex);
+    memset(g_devices, 0, sizeof(g_devices));
+}
+
+void ProcessEvents() {
+    vr::VREvent_t event;
+    while (g_pSystem->PollNextEvent(&event, sizeof(event))) {
+        switch (event.eventType) {
+        case vr::VREvent_TrackedDeviceActivated:
+        case vr::VREvent_TrackedDeviceDeactivated:
+        case vr::VREvent_TrackedDeviceUpdated:
+            if (event.trackedDeviceIndex < vr::k_unMaxTrackedDeviceCount)
+                RefreshDevice(event.trackedDeviceIndex);
+            break;
+        case vr::VREvent_TrackedDeviceRoleChanged:
+            for (vr::TrackedDeviceIndex_t i = 0; i < vr::k_unMaxTrackedDeviceCount; i++) {
+                int role = g_pSystem->GetControllerRoleForTrackedDeviceIndex(i);
+                std::lock_guard<std::mutex> lock(g_deviceMutex);
+                g_devices[i].role = role;
+            }
+            break;
+        case vr::VREvent_PropertyChanged:
+            if (event.trackedDeviceIndex >= vr::k_unMaxTrackedDeviceCount)
+                break;
+            if (event.data.property.prop == vr::Prop_DeviceBatteryPercentage_Float || event.data.property.prop == vr::Prop_DeviceIsCharging_Bool)
+                RefreshDeviceBattery(event.trackedDeviceIndex);
+            else
+                RefreshDevice(event.trackedDeviceIndex);
+            break;
+        case vr::VREvent_TrackedDeviceUserInteractionStarted:
+        case vr::VREvent_TrackedDeviceUserInteractionEnded:
+        case vr::VREvent_DashboardActivated:
+        case vr::VREvent_DashboardDeactivated:
+        case vr::VREvent_InputFocusChanged:
+        case vr::VREvent_SceneApplicationChanged:
+            g_renderStateDirty = true;
+            break;
+        case vr::VREvent_Quit:
+            // SteamVR is going away on purpose; UpdatePosesAndActions disconnects.
+            g_pSystem->AcknowledgeQuit_Exiting();
+            g_quitPending = true;
+            return;
+        }
+    }
+}
 
 LUA_FUNCTION(GetVersion) {
     LUA->PushNumber(23);
@@ -133,30 +1097,54 @@ LUA_FUNCTION(IsHMDPresent) {
     return 1;
 }
 
-LUA_FUNCTION(Init) {
-    if (g_pSystem != NULL)
-        LUA->ThrowError("VRMOD: Already initialized");
+double InitClock() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
+// Runtime stage of Init: VR_Init and the compositor. Touches no game or GL state, so it
+// can run on the init thread. Returns NULL on success or an error description.
+const char* InitRuntime(vr::IVRSystem** system) {
+    double start = InitClock();
     vr::HmdError error = vr::VRInitError_None;
-    g_pSystem = vr::VR_Init(&error, vr::VRApplication_Scene);
-    if (error != vr::VRInitError_None)
-        LUA->ThrowError(vr::VR_GetVRInitErrorAsEnglishDescription(error));
+    *system = vr::VR_Init(&error, vr::VRApplication_Scene);
+    g_initStageTimes[InitStage_Runtime] = InitClock() - start;
+    if (error != vr::VRInitError_None) {
+        *system = NULL;
+        return vr::VR_GetVRInitErrorAsEnglishDescription(error);
+    }
+
+    start = InitClock();
+    bool compositor = vr::VRCompositor() != NULL;
+    g_initStageTimes[InitStage_Compositor] = InitClock() - start;
+    if (!compositor)
+        return "VRMOD: VRCompositor failed";
+    return NULL;
+}
 
-    if (!vr::VRCompositor())
-        LUA->ThrowError("VRMOD: VRCompositor failed");
+// Main thread stage of Init: device cache, Lua tables and the renderer hooks, which need
+// the game's GL context or D3D device. Returns NULL on success or an error description.
+const char* InitGraphics(GarrysMod::Lua::ILuaBase* LUA) {
+    double start = InitClock();
+    StartDeviceCache();
+    g_initStageTimes[InitStage_Devices] = InitClock() - start;
 
+    start = InitClock();
     memset(g_luaRefs, 0, sizeof(g_luaRefs));
     for (int i = 0; i < LuaRefIndex_Max; i++) {
         LUA->CreateTable();
         g_luaRefs[i] = LUA->ReferenceCreate();
         g_luaRefCount++;
     }
+    for (unsigned int i = 0; i < vr::k_unMaxTrackedDeviceCount; i++) {
+        LUA->CreateTable();
+        g_devicePoseLuaRefs[i] = LUA->ReferenceCreate();
+    }
 
 #ifdef _WIN32
     HMODULE hMod = GetModuleHandleA("shaderapidx9.dll");
-    if (!hMod) LUA->ThrowError("VRMOD: Missing shaderapidx9.dll");
+    if (!hMod) return "VRMOD: Missing shaderapidx9.dll";
     CreateInterfaceFn CreateInterface = (CreateInterfaceFn)GetProcAddress(hMod, "CreateInterface");
-    if (!CreateInterface) LUA->ThrowError("VRMOD: Missing CreateInterface");
+    if (!CreateInterface) return "VRMOD: Missing CreateInterface";
 
 # ifdef _WIN64
     DWORD_PTR fnAddr = ((DWORD_PTR**)CreateInterface("ShaderDevice001", NULL))[0][5];
@@ -171,12 +1159,12 @@ LUA_FUNCTION(Init) {
 # else
     void *lib = dlopen("libtogl.so", RTLD_NOW | RTLD_NOLOAD);
 # endif
-    if (!lib) LUA->ThrowError("VRMOD: dlopen failed");
+    if (!lib) return "VRMOD: dlopen failed";
 
     pglBindFramebuffer = (PFNGLBINDFRAMEBUFFERPROC)glXGetProcAddress((const GLubyte *)"glBindFramebuffer");
 
     GetOpenGLEntryPoints_t GetOpenGLEntryPoints = (GetOpenGLEntryPoints_t)dlsym(lib, "GetOpenGLEntryPoints");
-    if (!GetOpenGLEntryPoints) LUA->ThrowError("VRMOD: dlsym failed");
+    if (!GetOpenGLEntryPoints) return "VRMOD: dlsym failed";
 
     g_GL = GetOpenGLEntryPoints(NULL);
     dlclose(lib);
@@ -204,6 +1192,83 @@ LUA_FUNCTION(Init) {
 
 #endif
 
+    g_initStageTimes[InitStage_Graphics] = InitClock() - start;
+    return NULL;
+}
+
+void InitThreadMain() {
+    vr::IVRSystem* system = NULL;
+    const char* error = InitRuntime(&system);
+    // When reconnecting keep retrying until SteamVR is back or Shutdown is called.
+    while (error != NULL && g_reconnecting) {
+        if (system != NULL)
+            vr::VR_Shutdown();
+        std::unique_lock<std::mutex> lock(g_initMutex);
+        if (g_initCond.wait_for(lock, std::chrono::milliseconds(RECONNECT_RETRY_MS), [] { return g_initThreadStop; }))
+            return;
+        lock.unlock();
+        error = InitRuntime(&system);
+    }
+    std::lock_guard<std::mutex> lock(g_initMutex);
+    if (error != NULL) {
+        if (system != NULL)
+            vr::VR_Shutdown();
+        snprintf(g_initError, MAX_STR_LEN, "%s", error);
+        g_initState = InitState_Failed;
+    }
+    else {
+        g_initSystem = system;
+        g_initState = InitState_RuntimeReady;
+    }
+}
+
+// Waits for the init thread, if any. A runtime connected but not yet picked up by
+// GetInitState is adopted so Shutdown can release it.
+void JoinInitThread() {
+    if (g_initThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(g_initMutex);
+            g_initThreadStop = true;
+        }
+        g_initCond.notify_all();
+        g_initThread.join();
+    }
+    if (g_initState == InitState_RuntimeReady) {
+        g_pSystem = g_initSystem;
+        g_initSystem = NULL;
+    }
+    g_initState = InitState_None;
+    g_initThreadStop = false;
+    g_reconnecting = false;
+    g_quitPending = false;
+}
+
+LUA_FUNCTION(Init) {
+    if (g_pSystem != NULL || g_initThread.joinable() || g_reconnecting)
+        LUA->ThrowError("VRMOD: Already initialized");
+
+    memset(g_initStageTimes, 0, sizeof(g_initStageTimes));
+    vr::IVRSystem* system = NULL;
+    const char* error = InitRuntime(&system);
+    g_pSystem = system;
+    if (error != NULL)
+        LUA->ThrowError(error);
+
+    error = InitGraphics(LUA);
+    if (error != NULL)
+        LUA->ThrowError(error);
+    g_initState = InitState_Ready;
+    return 0;
+}
+
+LUA_FUNCTION(InitAsync) {
+    if (g_pSystem != NULL || g_initThread.joinable() || g_reconnecting)
+        LUA->ThrowError("VRMOD: Already initialized");
+    memset(g_initStageTimes, 0, sizeof(g_initStageTimes));
+    g_initError[0] = 0;
+    g_initStartTime = InitClock();
+    g_initState = InitState_Connecting;
+    g_initThread = std::thread(InitThreadMain);
     return 0;
 }
 
@@ -219,9 +1284,13 @@ LUA_FUNCTION(SetActionManifest) {
 #endif
     if (snprintf(path, PATH_MAX, "%s/garrysmod/data/%s", currentDir, fileName) >= PATH_MAX)
         LUA->ThrowError("VRMOD: SetActionManifest path too long");
-    g_pInput = vr::VRInput();
-    if (g_pInput->SetActionManifestPath(path) != vr::VRInputError_None)
-        LUA->ThrowError("VRMOD: SetActionManifestPath failed");
+    // While reconnecting the manifest is applied and the handles resolved by ResumeRuntime.
+    if (!g_reconnecting) {
+        g_pInput = vr::VRInput();
+        if (g_pInput->SetActionManifestPath(path) != vr::VRInputError_None)
+            LUA->ThrowError("VRMOD: SetActionManifestPath failed");
+    }
+    snprintf(g_actionManifestPath, PATH_MAX, "%s", path);
     FILE* file = fopen(path, "r");
     if (file == NULL)
         LUA->ThrowError("VRMOD: failed to open action manifest");
@@ -242,7 +1311,8 @@ LUA_FUNCTION(SetActionManifest) {
                 if (g_actions[g_actionCount].fullname[i] == '/')
                     g_actions[g_actionCount].name = g_actions[g_actionCount].fullname + i + 1;
             }
-            g_pInput->GetActionHandle(g_actions[g_actionCount].fullname, &(g_actions[g_actionCount].handle));
+            if (!g_reconnecting)
+                g_pInput->GetActionHandle(g_actions[g_actionCount].fullname, &(g_actions[g_actionCount].handle));
         }
         if (strcmp(word, "type") == 0) {
             char typeStr[MAX_STR_LEN] = {0};
@@ -252,10 +1322,11 @@ LUA_FUNCTION(SetActionManifest) {
                 g_actions[g_actionCount].type += typeStr[i];
         }
         if (g_actions[g_actionCount].fullname[0] && g_actions[g_actionCount].type) {
-            for(int i = 0; i < 2; i++){
+            for(int i = 0; i < ACTION_LUAREFS; i++){
                 LUA->CreateTable();
                 g_actions[g_actionCount].luaRefs[i] = LUA->ReferenceCreate();
             }
+            g_actions[g_actionCount].summaryType = vr::VRSummaryType_FromDevice;
             g_actionCount++;
             if (g_actionCount == MAX_ACTIONS)
                 break;
@@ -265,6 +1336,14 @@ LUA_FUNCTION(SetActionManifest) {
     return 0;
 }
 
+int FindAction(const char* name) {
+    for (int i = 0; i < g_actionCount; i++) {
+        if (strcmp(g_actions[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
 LUA_FUNCTION(SetActiveActionSets) {
     g_activeActionSetCount = 0;
     for (int i = 0; i < MAX_ACTIONSETS; i++) {
@@ -278,12 +1357,16 @@ LUA_FUNCTION(SetActiveActionSets) {
                 }
             }
             if (actionSetIndex == -1) {
-                g_pInput->GetActionSetHandle(actionSetName, &g_actionSets[g_actionSetCount].handle);
+                // While reconnecting only the name is kept; ResumeRuntime resolves it.
+                g_actionSets[g_actionSetCount].handle = vr::k_ulInvalidActionSetHandle;
+                if (!g_reconnecting)
+                    g_pInput->GetActionSetHandle(actionSetName, &g_actionSets[g_actionSetCount].handle);
                 memcpy(g_actionSets[g_actionSetCount].name, actionSetName, strlen(actionSetName));
                 actionSetIndex = g_actionSetCount;
                 g_actionSetCount++;
             }
             g_activeActionSets[g_activeActionSetCount].ulActionSet = g_actionSets[actionSetIndex].handle;
+            g_activeActionSetIndices[g_activeActionSetCount] = actionSetIndex;
             g_activeActionSetCount++;
         }
         else {
@@ -314,9 +1397,27 @@ void LuaPrint(GarrysMod::Lua::ILuaBase* LUA, const char* msg) {
     LUA->Call(1, 0);
     LUA->Pop(1);
 }
+
+float GetNumberField(GarrysMod::Lua::ILuaBase* LUA, const char* name, float defaultValue) {
+    LUA->GetField(-1, name);
+    float value = LUA->IsType(-1, GarrysMod::Lua::Type::NUMBER) ? (float)LUA->GetNumber(-1) : defaultValue;
+    LUA->Pop(1);
+    return value;
+}
+
+Vector GetVectorField(GarrysMod::Lua::ILuaBase* LUA, const char* name, const Vector& defaultValue) {
+    LUA->GetField(-1, name);
+    Vector value = LUA->IsType(-1, GarrysMod::Lua::Type::Vector) ? LUA->GetVector(-1) : defaultValue;
+    LUA->Pop(1);
+    return value;
+}
 LUA_FUNCTION(GetDisplayInfo) {
     float fNearZ = (float)LUA->CheckNumber(1);
     float fFarZ = (float)LUA->CheckNumber(2);
+    if (g_reconnecting)
+        LUA->ThrowError("VRMOD: runtime reconnecting");
+    if (g_pSystem == NULL)
+        LUA->ThrowError("VRMOD: not initialized");
     uint32_t recommendedWidth = 0;
     uint32_t recommendedHeight = 0;
     g_pSystem->GetRecommendedRenderTargetSize(&recommendedWidth, &recommendedHeight);
@@ -324,6 +1425,10 @@ LUA_FUNCTION(GetDisplayInfo) {
     vr::HmdMatrix44_t projRight = g_pSystem->GetProjectionMatrix(vr::Hmd_Eye::Eye_Right, fNearZ, fFarZ);
     vr::HmdMatrix34_t transformLeft = g_pSystem->GetEyeToHeadTransform(vr::Eye_Left);
     vr::HmdMatrix34_t transformRight = g_pSystem->GetEyeToHeadTransform(vr::Eye_Right);
+    // Kept for depth submission, which needs the projection the depth buffer was rendered with.
+    g_eyeProjection[vr::Eye_Left] = projLeft;
+    g_eyeProjection[vr::Eye_Right] = projRight;
+    g_hasEyeProjection = true;
     LUA->CreateTable();
     PushMatrixAsTable(LUA, (float*)&projLeft, 4, 4);
     LUA->SetField(-2, "ProjectionLeft");
@@ -340,60 +1445,2066 @@ LUA_FUNCTION(GetDisplayInfo) {
     return 1;
 }
 
-LUA_FUNCTION(UpdatePosesAndActions) {
-    vr::VRCompositor()->WaitGetPoses(g_poses, vr::k_unMaxTrackedDeviceCount, NULL, 0);
-    g_pInput->UpdateActionState(g_activeActionSets, sizeof(vr::VRActiveActionSet_t), g_activeActionSetCount);
-    return 0;
+void RecordPoseHistory(int track, const vr::TrackedDevicePose_t& pose) {
+    poseHistory* h = &g_poseHistory[track];
+    if (h->count > 0 && h->samples[(h->head + g_poseHistoryCapacity - 1) % g_poseHistoryCapacity].time >= g_frameTime)
+        return;
+    historySample* sample = &h->samples[h->head];
+    sample->time = g_frameTime;
+    sample->valid = pose.bPoseIsValid;
+    sample->mat = pose.mDeviceToAbsoluteTracking;
+    h->head = (h->head + 1) % g_poseHistoryCapacity;
+    if (h->count < g_poseHistoryCapacity)
+        h->count++;
+}
+
+void ResetPoseHistory() {
+    for (int i = 0; i < (int)HISTORY_TRACKS; i++) {
+        g_poseHistory[i].samples = g_poseHistoryBuffer + i * g_poseHistoryCapacity;
+        g_poseHistory[i].head = 0;
+        g_poseHistory[i].count = 0;
+    }
+}
+
+void UpdateFrameTiming() {
+    double now = InitClock();
+    g_frameTiming.m_nSize = sizeof(vr::Compositor_FrameTiming);
+    // While the compositor is stalled keep the frame clock running without asking it.
+    if (g_waitStalled)
+        g_frameTime += now - g_frameClock;
+    else if (vr::VRCompositor()->GetFrameTiming(&g_frameTiming, 0))
+        g_frameTime = g_frameTiming.m_flSystemTimeInSeconds;
+    else
+        g_frameTime = now;
+    g_frameClock = now;
+}
+
+void WaitThreadMain(std::shared_ptr<waitState> wait) {
+    std::unique_lock<std::mutex> lock(wait->mutex);
+    while (true) {
+        wait->cond.wait(lock, [&] { return wait->requested || wait->stop; });
+        if (wait->stop)
+            return;
+        wait->requested = false;
+        vr::IVRCompositor* compositor = wait->compositor;
+        lock.unlock();
+        vr::EVRCompositorError result = compositor->WaitGetPoses(wait->poses, vr::k_unMaxTrackedDeviceCount, NULL, 0);
+        lock.lock();
+        wait->result = result;
+        wait->busy = false;
+        wait->doneCond.notify_all();
+    }
+}
+
+bool WaitThreadBusy() {
+    std::lock_guard<std::mutex> lock(g_wait->mutex);
+    return g_wait->busy;
+}
+
+// Joins the abandoned wait threads whose WaitGetPoses has returned, giving the others up
+// to timeout seconds. Returns true once none are left.
+bool ReapWaitThreads(double timeout) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+    for (int i = 0; i < g_abandonedWaitCount;) {
+        abandonedWait* a = &g_abandonedWaits[i];
+        waitState* wait = a->state.get();
+        bool done;
+        {
+            std::unique_lock<std::mutex> lock(wait->mutex);
+            done = wait->doneCond.wait_until(lock, deadline, [&] { return !wait->busy; });
+        }
+        if (!done) {
+            i++;
+            continue;
+        }
+        a->thread.join();
+        a->state.reset();
+        g_abandonedWaitCount--;
+        if (i != g_abandonedWaitCount) {
+            a->thread = std::move(g_abandonedWaits[g_abandonedWaitCount].thread);
+            a->state = std::move(g_abandonedWaits[g_abandonedWaitCount].state);
+        }
+    }
+    return g_abandonedWaitCount == 0;
+}
+
+// A thread still stuck in WaitGetPoses is set aside instead of joined so that shutting
+// down or reconnecting during a compositor stall doesn't freeze the game. It exits as
+// soon as the wait returns and is joined by a later call.
+void StopWaitThread() {
+    if (g_waitThread.joinable()) {
+        bool busy;
+        {
+            std::lock_guard<std::mutex> lock(g_wait->mutex);
+            g_wait->stop = true;
+            busy = g_wait->busy;
+        }
+        g_wait->cond.notify_all();
+        if (busy && g_abandonedWaitCount < MAX_ABANDONED_WAITS) {
+            abandonedWait* a = &g_abandonedWaits[g_abandonedWaitCount++];
+            a->thread = std::move(g_waitThread);
+            a->state = g_wait;
+        }
+        else {
+            g_waitThread.join();
+        }
+        g_wait.reset();
+    }
+    ReapWaitThreads(0.0);
+    g_waitStalled = false;
+}
+
+// Keeps the module mapped until the process exits.
+void PinModule() {
+#ifdef _WIN32
+    HMODULE module;
+    GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN, (LPCSTR)&PinModule, &module);
+#else
+    Dl_info info;
+    if (dladdr((void*)&PinModule, &info) && info.dli_fname != NULL)
+        dlopen(info.dli_fname, RTLD_NOW | RTLD_NOLOAD | RTLD_NODELETE);
+#endif
+}
+
+// Before the module is unloaded every wait thread has to be gone, as one still inside
+// WaitGetPoses would return into unmapped code. VR_Shutdown makes a pending wait return,
+// so this is called after it; a thread that still doesn't finish in time keeps the module
+// loaded instead.
+void FinishWaitThreads() {
+    if (ReapWaitThreads(WAIT_UNLOAD_TIMEOUT))
+        return;
+    PinModule();
+    for (int i = 0; i < g_abandonedWaitCount; i++) {
+        g_abandonedWaits[i].thread.detach();
+        g_abandonedWaits[i].state.reset();
+    }
+    g_abandonedWaitCount = 0;
+}
+
+// WaitGetPoses on the wait thread with a deadline of a few refresh periods. On timeout
+// the frame continues with poses from IVRSystem, and while the wait stays stuck later
+// frames don't wait at all, so the game keeps running at desktop rate.
+vr::EVRCompositorError WaitGetPosesWatchdog() {
+    if (!g_waitThread.joinable()) {
+        g_wait = std::make_shared<waitState>();
+        g_waitThread = std::thread(WaitThreadMain, g_wait);
+    }
+    waitState* wait = g_wait.get();
+    double now = InitClock();
+    {
+        std::unique_lock<std::mutex> lock(wait->mutex);
+        if (!wait->busy) {
+            wait->busy = true;
+            wait->requested = true;
+            wait->compositor = vr::VRCompositor();
+            g_waitStartTime = now;
+            wait->cond.notify_one();
+        }
+        double deadline = g_waitStalled ? 0.0 : g_waitDeadlineFrames / g_displayFrequency;
+        if (wait->doneCond.wait_for(lock, std::chrono::duration<double>(deadline), [&] { return !wait->busy; })) {
+            memcpy(g_poses, wait->poses, sizeof(g_poses));
+            if (g_waitStalled) {
+                double duration = InitClock() - g_waitStartTime;
+                g_watchdogStats.lastStall = duration;
+                g_watchdogStats.totalStall += duration;
+                if (duration > g_watchdogStats.longestStall)
+                    g_watchdogStats.longestStall = duration;
+                g_waitStalled = false;
+            }
+            return wait->result;
+        }
+    }
+    if (!g_waitStalled) {
+        g_waitStalled = true;
+        g_watchdogStats.stalls++;
+    }
+    g_watchdogStats.stalledFrames++;
+    g_pSystem->GetDeviceToAbsoluteTrackingPose(vr::TrackingUniverseStanding, 0.0f, g_poses, vr::k_unMaxTrackedDeviceCount);
+    return vr::VRCompositorError_None;
+}
+
+// Refreshes user presence, dashboard visibility and scene focus after a related event,
+// and every RENDER_STATE_POLL seconds in case one was missed.
+void UpdateRenderState() {
+    double now = InitClock();
+    if (!g_renderStateDirty && now - g_renderStateTime < RENDER_STATE_POLL)
+        return;
+    vr::EDeviceActivityLevel activity = g_pSystem->GetTrackedDeviceActivityLevel(vr::k_unTrackedDeviceIndex_Hmd);
+    g_userPresent = activity == vr::k_EDeviceActivityLevel_UserInteraction || activity == vr::k_EDeviceActivityLevel_UserInteraction_Timeout;
+    g_dashboardVisible = vr::VROverlay() != NULL && vr::VROverlay()->IsDashboardVisible();
+    g_sceneFocus = vr::VRCompositor()->CanRenderScene();
+    g_renderStateDirty = false;
+    g_renderStateTime = now;
+}
+
+bool ShouldRenderScene() {
+    return !g_loadingMode && (!g_renderSuspension || (g_userPresent && !g_dashboardVisible && g_sceneFocus));
+}
+
+LUA_FUNCTION(SetRenderSuspension) {
+    g_renderSuspension = LUA->GetBool(1);
+    if (LUA->IsType(2, GarrysMod::Lua::Type::NUMBER))
+        g_keepAliveInterval = (float)LUA->GetNumber(2);
+    g_renderStateDirty = true;
+    return 0;
+}
+
+// Returns whether the frame is worth rendering, plus the reason when it isn't.
+LUA_FUNCTION(ShouldRender) {
+    bool render = ShouldRenderScene();
+    LUA->PushBool(render);
+    if (render)
+        return 1;
+    LUA->PushString(g_loadingMode ? "loading" : (!g_userPresent ? "hmdidle" : (g_dashboardVisible ? "dashboard" : "nofocus")));
+    return 2;
+}
+
+// Forces interleaved reprojection on when the application's frame cost stays above the
+// high threshold (fraction of the full rate frame budget) for engageFrames frames, and
+// back off once it stays below the low threshold for releaseFrames frames. Switches are
+// at least minHold seconds apart.
+void UpdateReprojection() {
+    reprojectionController* c = &g_reprojection;
+    float budget = 1000.0f / g_displayFrequency;
+    float gpu = g_frameTiming.m_flPreSubmitGpuMs + g_frameTiming.m_flPostSubmitGpuMs;
+    float cpu = g_frameTiming.m_flNewFrameReadyMs - g_frameTiming.m_flNewPosesReadyMs;
+    float load = (gpu > cpu ? gpu : cpu) / budget;
+    // A dropped frame at full rate counts as over budget whatever the timings say.
+    if (!c->halfRate && g_frameTiming.m_nNumDroppedFrames > 0 && load < c->high)
+        load = c->high;
+    c->load += (load - c->load) * 0.1f;
+    c->overCount = load >= c->high ? c->overCount + 1 : 0;
+    c->underCount = c->load <= c->low ? c->underCount + 1 : 0;
+    bool halfRate = c->halfRate;
+    if (!halfRate && c->overCount >= c->engageFrames)
+        halfRate = true;
+    else if (halfRate && c->underCount >= c->releaseFrames)
+        halfRate = false;
+    if (halfRate == c->halfRate || g_frameTime - c->lastSwitch < c->minHold)
+        return;
+    c->halfRate = halfRate;
+    c->lastSwitch = g_frameTime;
+    c->overCount = c->underCount = 0;
+    reprojectionSwitch* entry = &c->history[c->switchCount % REPROJECTION_HISTORY];
+    entry->time = g_frameTime;
+    entry->halfRate = halfRate;
+    entry->load = c->load;
+    c->switchCount++;
+    vr::VRCompositor()->ForceInterleavedReprojectionOn(halfRate);
+}
+
+void InitReprojection() {
+    reprojectionController* c = &g_reprojection;
+    memset(c, 0, sizeof(*c));
+    c->high = 0.9f;
+    c->low = 0.7f;
+    c->engageFrames = 10;
+    c->releaseFrames = 90;
+    c->minHold = 2.0f;
+}
+
+LUA_FUNCTION(SetReprojectionController) {
+    reprojectionController* c = &g_reprojection;
+    c->enabled = LUA->GetBool(1);
+    if (LUA->IsType(2, GarrysMod::Lua::Type::TABLE)) {
+        LUA->Push(2);
+        c->high = GetNumberField(LUA, "high", c->high);
+        c->low = GetNumberField(LUA, "low", c->low);
+        c->engageFrames = (int)GetNumberField(LUA, "engageFrames", (float)c->engageFrames);
+        c->releaseFrames = (int)GetNumberField(LUA, "releaseFrames", (float)c->releaseFrames);
+        c->minHold = GetNumberField(LUA, "minHold", c->minHold);
+        LUA->Pop(1);
+    }
+    if (!c->enabled && c->halfRate) {
+        c->halfRate = false;
+        if (g_pSystem != NULL)
+            vr::VRCompositor()->ForceInterleavedReprojectionOn(false);
+    }
+    return 0;
+}
+
+LUA_FUNCTION(IsHalfRate) {
+    LUA->PushBool(g_reprojection.halfRate);
+    return 1;
+}
+
+// Returns the smoothed load and the most recent switches, oldest first.
+LUA_FUNCTION(GetReprojectionHistory) {
+    const reprojectionController* c = &g_reprojection;
+    LUA->CreateTable();
+    LUA->PushNumber(c->load);
+    LUA->SetField(-2, "load");
+    LUA->PushNumber(c->switchCount);
+    LUA->SetField(-2, "switchCount");
+    LUA->CreateTable();
+    int first = c->switchCount > REPROJECTION_HISTORY ? c->switchCount - REPROJECTION_HISTORY : 0;
+    for (int i = first; i < c->switchCount; i++) {
+        const reprojectionSwitch* entry = &c->history[i % REPROJECTION_HISTORY];
+        LUA->PushNumber(i - first + 1);
+        LUA->CreateTable();
+        LUA->PushNumber(entry->time);
+        LUA->SetField(-2, "time");
+        LUA->PushBool(entry->halfRate);
+        LUA->SetField(-2, "halfRate");
+        LUA->PushNumber(entry->load);
+        LUA->SetField(-2, "load");
+        LUA->SetTable(-3);
+    }
+    LUA->SetField(-2, "switches");
+    return 1;
+}
+
+LUA_FUNCTION(SetFrameScheduling) {
+    g_runningStart = LUA->GetBool(1);
+    g_waitLead = LUA->IsType(2, GarrysMod::Lua::Type::NUMBER) ? (float)LUA->GetNumber(2) : 0.0f;
+    return 0;
+}
+
+LUA_FUNCTION(GetFrameTimeRemaining) {
+    LUA->PushNumber(g_pSystem != NULL && !g_waitStalled ? vr::VRCompositor()->GetFrameTimeRemaining() : 0.0f);
+    return 1;
+}
+
+// Times are from the last frame, in seconds.
+LUA_FUNCTION(GetFrameTimingStats) {
+    LUA->CreateTable();
+    LUA->PushBool(g_runningStart);
+    LUA->SetField(-2, "runningStart");
+    LUA->PushNumber(g_frameStats.wait);
+    LUA->SetField(-2, "wait");
+    LUA->PushNumber(g_frameStats.sleep);
+    LUA->SetField(-2, "sleep");
+    LUA->PushNumber(g_frameStats.poseToSubmit);
+    LUA->SetField(-2, "poseToSubmit");
+    LUA->PushNumber(g_frameStats.submitToWait);
+    LUA->SetField(-2, "submitToWait");
+    LUA->PushNumber(g_frameStats.frameInterval);
+    LUA->SetField(-2, "frameInterval");
+    LUA->PushNumber(g_frameStats.poseToSubmit + g_vsyncToPhotons + (float)g_frameTiming.m_flCompositorRenderGpuMs / 1000.0f);
+    LUA->SetField(-2, "motionToPhotons");
+    LUA->PushNumber((float)g_frameTiming.m_flTotalRenderGpuMs / 1000.0f);
+    LUA->SetField(-2, "compositorGpu");
+    LUA->PushNumber(g_frameStats.frames);
+    LUA->SetField(-2, "frames");
+    LUA->PushNumber(g_frameStats.droppedFrames);
+    LUA->SetField(-2, "droppedFrames");
+    LUA->PushNumber(g_frameStats.misPresented);
+    LUA->SetField(-2, "misPresented");
+    return 1;
+}
+
+LUA_FUNCTION(SetWaitWatchdog) {
+    g_waitWatchdog = LUA->GetBool(1);
+    if (LUA->IsType(2, GarrysMod::Lua::Type::NUMBER))
+        g_waitDeadlineFrames = (float)LUA->GetNumber(2);
+    return 0;
+}
+
+LUA_FUNCTION(GetWatchdogStats) {
+    LUA->CreateTable();
+    LUA->PushBool(g_waitStalled);
+    LUA->SetField(-2, "stalled");
+    LUA->PushNumber(g_watchdogStats.stalls);
+    LUA->SetField(-2, "stalls");
+    LUA->PushNumber(g_watchdogStats.stalledFrames);
+    LUA->SetField(-2, "stalledFrames");
+    LUA->PushNumber(g_waitStalled ? InitClock() - g_waitStartTime : 0.0);
+    LUA->SetField(-2, "currentStall");
+    LUA->PushNumber(g_watchdogStats.lastStall);
+    LUA->SetField(-2, "lastStall");
+    LUA->PushNumber(g_watchdogStats.longestStall);
+    LUA->SetField(-2, "longestStall");
+    LUA->PushNumber(g_watchdogStats.totalStall);
+    LUA->SetField(-2, "totalStall");
+    return 1;
+}
+
+// One-Euro filter (Casiez et al.) over a group of count values. The cutoff adapts to the
+// magnitude of the group's filtered derivative, so a pose position or a thumbstick is
+// smoothed as one signal rather than per axis.
+void OneEuroFilter(actionFilter* f, float* value, float* deriv, float* x, int count, float dt) {
+    const float dCutoff = 1.0f;
+    float dAlpha = 1.0f / (1.0f + 1.0f / (2.0f * PI_F * dCutoff * dt));
+    float speed = 0.0f;
+    for (int i = 0; i < count; i++) {
+        deriv[i] += dAlpha * ((x[i] - value[i]) / dt - deriv[i]);
+        speed += deriv[i] * deriv[i];
+    }
+    float cutoff = f->minCutoff + f->beta * sqrtf(speed);
+    float alpha = 1.0f / (1.0f + 1.0f / (2.0f * PI_F * cutoff * dt));
+    for (int i = 0; i < count; i++) {
+        value[i] += alpha * (x[i] - value[i]);
+        x[i] = value[i];
+    }
+}
+
+// Returns the time step since the filter last ran, or 0 if it already ran this frame.
+float FilterStep(actionFilter* f) {
+    float dt = (float)(g_frameTime - f->lastTime);
+    if (!f->primed || dt <= 0.0f || dt > 1.0f)
+        dt = 0.0f;
+    f->lastTime = g_frameTime;
+    return dt;
+}
+
+void FilterPose(actionFilter* f, vr::TrackedDevicePose_t* pose) {
+    vr::HmdMatrix34_t& mat = pose->mDeviceToAbsoluteTracking;
+    if (f->minCutoff <= 0.0f)
+        return;
+    float x[7] = { mat.m[0][3], mat.m[1][3], mat.m[2][3] };
+    MatrixToQuat(mat.m, x + 3);
+    bool sameFrame = f->primed && g_frameTime == f->lastTime;
+    float dt = FilterStep(f);
+    if (sameFrame) {
+        memcpy(x, f->value, sizeof(x));
+    }
+    else if (dt == 0.0f) {
+        memcpy(f->value, x, sizeof(x));
+        memset(f->deriv, 0, sizeof(f->deriv));
+        f->primed = true;
+        return;
+    }
+    else {
+        if (x[3] * f->value[3] + x[4] * f->value[4] + x[5] * f->value[5] + x[6] * f->value[6] < 0.0f) {
+            for (int i = 3; i < 7; i++)
+                x[i] = -x[i];
+        }
+        OneEuroFilter(f, f->value, f->deriv, x, 3, dt);
+        OneEuroFilter(f, f->value + 3, f->deriv + 3, x + 3, 4, dt);
+        float len = 1.0f / sqrtf(x[3] * x[3] + x[4] * x[4] + x[5] * x[5] + x[6] * x[6]);
+        for (int i = 3; i < 7; i++)
+            x[i] *= len;
+    }
+    QuatToMatrix(x + 3, mat.m);
+    mat.m[0][3] = x[0];
+    mat.m[1][3] = x[1];
+    mat.m[2][3] = x[2];
+}
+
+// Applies the radial deadzone and response curve, then smoothing, to a Vector1 (count 1)
+// or Vector2 (count 2) action value.
+void FilterAnalog(actionFilter* f, float* x, int count) {
+    float magnitude = count == 1 ? fabsf(x[0]) : sqrtf(x[0] * x[0] + x[1] * x[1]);
+    if (magnitude > 0.0f) {
+        float scaled = (magnitude - f->deadzone) / (1.0f - f->deadzone);
+        scaled = scaled < 0.0f ? 0.0f : (scaled > 1.0f ? 1.0f : scaled);
+        if (f->curve > 0.0f && f->curve != 1.0f)
+            scaled = powf(scaled, f->curve);
+        for (int i = 0; i < count; i++)
+            x[i] *= scaled / magnitude;
+    }
+    if (f->minCutoff <= 0.0f)
+        return;
+    bool sameFrame = f->primed && g_frameTime == f->lastTime;
+    float dt = FilterStep(f);
+    if (sameFrame) {
+        memcpy(x, f->value, sizeof(float) * count);
+    }
+    else if (dt == 0.0f) {
+        memcpy(f->value, x, sizeof(float) * count);
+        memset(f->deriv, 0, sizeof(f->deriv));
+        f->primed = true;
+    }
+    else {
+        OneEuroFilter(f, f->value, f->deriv, x, count, dt);
+    }
+}
+
+LUA_FUNCTION(SetActionFilter) {
+    int actionIndex = FindAction(LUA->CheckString(1));
+    if (actionIndex == -1)
+        LUA->ThrowError("VRMOD: SetActionFilter unknown action");
+    int type = g_actions[actionIndex].type;
+    if (type != ActionType_Pose && type != ActionType_Vector1 && type != ActionType_Vector2)
+        LUA->ThrowError("VRMOD: SetActionFilter only supports pose, vector1 and vector2 actions");
+    actionFilter* f = &g_actions[actionIndex].filter;
+    memset(f, 0, sizeof(actionFilter));
+    f->minCutoff = LUA->IsType(2, GarrysMod::Lua::Type::NUMBER) ? (float)LUA->GetNumber(2) : 0.0f;
+    f->beta = LUA->IsType(3, GarrysMod::Lua::Type::NUMBER) ? (float)LUA->GetNumber(3) : 0.0f;
+    f->deadzone = LUA->IsType(4, GarrysMod::Lua::Type::NUMBER) ? (float)LUA->GetNumber(4) : 0.0f;
+    f->curve = LUA->IsType(5, GarrysMod::Lua::Type::NUMBER) ? (float)LUA->GetNumber(5) : 1.0f;
+    f->deadzone = f->deadzone < 0.0f ? 0.0f : (f->deadzone > 0.99f ? 0.99f : f->deadzone);
+    f->enabled = f->minCutoff > 0.0f || f->deadzone > 0.0f || f->curve != 1.0f;
+    return 0;
+}
+
+// Pushes the stored state of an overlay to the runtime, after creating it or reconnecting.
+vr::EVROverlayError ApplyOverlayState(const vrOverlay* o) {
+    vr::IVROverlay* overlay = vr::VROverlay();
+    vr::EVROverlayError error = overlay->SetOverlayWidthInMeters(o->handle, o->width);
+    if (error == vr::VROverlayError_None && o->device != vr::k_unTrackedDeviceIndexInvalid)
+        error = overlay->SetOverlayTransformTrackedDeviceRelative(o->handle, o->device, &o->transform);
+    else if (error == vr::VROverlayError_None)
+        error = overlay->SetOverlayTransformAbsolute(o->handle, vr::TrackingUniverseStanding, &o->transform);
+    if (error == vr::VROverlayError_None)
+        error = overlay->SetOverlayTextureBounds(o->handle, &o->bounds);
+    if (error == vr::VROverlayError_None && o->hasTexture)
+        error = overlay->SetOverlayTexture(o->handle, &o->texture);
+    if (error == vr::VROverlayError_None)
+        error = o->visible ? overlay->ShowOverlay(o->handle) : overlay->HideOverlay(o->handle);
+    return error;
+}
+
+// Shows the loading view recorded by BeginLoadingMode in the compositor, also on a new
+// runtime after a reconnect.
+vr::EVRCompositorError ApplyLoadingMode(float fade) {
+    vr::IVRCompositor* compositor = vr::VRCompositor();
+    // Fall back to the grid if the skybox overlay was destroyed in the meantime.
+    if (g_loadingSkybox && !g_overlays[g_loadingOverlay].used)
+        g_loadingSkybox = false;
+    if (g_loadingSkybox) {
+        vr::EVRCompositorError error = compositor->SetSkyboxOverride(&g_overlays[g_loadingOverlay].texture, 1);
+        if (error != vr::VRCompositorError_None)
+            return error;
+    }
+    else if (g_loadingColor) {
+        compositor->FadeToColor(fade, g_loadingRGB[0], g_loadingRGB[1], g_loadingRGB[2], 1.0f);
+    }
+    else {
+        compositor->FadeGrid(fade, true);
+    }
+    compositor->SuspendRendering(true);
+    return vr::VRCompositorError_None;
+}
+
+// Re-resolves everything cached from the previous runtime after a reconnect. Lua tables,
+// actions and the shared texture are kept as they are.
+const char* ResumeRuntime() {
+    StartDeviceCache();
+    g_pInput = vr::VRInput();
+    if (g_actionManifestPath[0] && g_pInput->SetActionManifestPath(g_actionManifestPath) != vr::VRInputError_None)
+        return "VRMOD: SetActionManifestPath failed";
+    for (int i = 0; i < g_actionCount; i++)
+        g_pInput->GetActionHandle(g_actions[i].fullname, &g_actions[i].handle);
+    for (int i = 0; i < g_actionSetCount; i++)
+        g_pInput->GetActionSetHandle(g_actionSets[i].name, &g_actionSets[i].handle);
+    for (int i = 0; i < g_activeActionSetCount; i++)
+        g_activeActionSets[i].ulActionSet = g_actionSets[g_activeActionSetIndices[i]].handle;
+    for (int i = 0; i < MAX_OVERLAYS; i++) {
+        vrOverlay* o = &g_overlays[i];
+        if (o->used && vr::VROverlay()->CreateOverlay(o->key, o->name, &o->handle) == vr::VROverlayError_None)
+            ApplyOverlayState(o);
+    }
+    if (g_reprojection.halfRate)
+        vr::VRCompositor()->ForceInterleavedReprojectionOn(true);
+    if (g_loadingMode)
+        ApplyLoadingMode(0.0f);
+    return NULL;
+}
+
+// Finishes InitAsync or a reconnect on the main thread once the init thread has connected.
+EInitState PollInitThread(GarrysMod::Lua::ILuaBase* LUA) {
+    EInitState state;
+    {
+        std::lock_guard<std::mutex> lock(g_initMutex);
+        state = g_initState;
+    }
+    if (state == InitState_RuntimeReady || (state == InitState_Failed && g_initThread.joinable())) {
+        g_initThread.join();
+        if (state == InitState_RuntimeReady) {
+            g_pSystem = g_initSystem;
+            g_initSystem = NULL;
+            const char* error = g_reconnecting ? ResumeRuntime() : InitGraphics(LUA);
+            if (error != NULL)
+                snprintf(g_initError, MAX_STR_LEN, "%s", error);
+            state = g_initState = error == NULL ? InitState_Ready : InitState_Failed;
+            if (g_reconnecting && error == NULL)
+                g_reconnectCount++;
+            g_reconnecting = false;
+        }
+    }
+    return state;
+}
+
+// Drops the runtime. After a failure it is reconnected on the init thread right away. After
+// SteamVR was quit on purpose nothing happens until vrmod.Reconnect, as VR_Init would just
+// launch it again. Until then the per-frame functions return their previous results.
+void BeginReconnect(bool retry) {
+    StopWaitThread();
+    StopDeviceCache();
+    vr::VR_Shutdown();
+    g_pSystem = NULL;
+    g_pInput = NULL;
+    g_quitPending = false;
+    g_reconnecting = true;
+    g_initError[0] = 0;
+    g_initStartTime = InitClock();
+    if (retry) {
+        g_initState = InitState_Connecting;
+        g_initThread = std::thread(InitThreadMain);
+    }
+    else {
+        g_initState = InitState_Disconnected;
+    }
+}
+
+LUA_FUNCTION(Reconnect) {
+    if (g_initState != InitState_Disconnected)
+        return 0;
+    g_initStartTime = InitClock();
+    g_initState = InitState_Connecting;
+    g_initThread = std::thread(InitThreadMain);
+    return 0;
+}
+
+// Polled each frame after InitAsync. Runs the main thread stage once the runtime is up.
+LUA_FUNCTION(GetInitState) {
+    static const char* stateNames[] = { "none", "connecting", "connecting", "ready", "failed", "disconnected" };
+    static const char* stageNames[InitStage_Max] = { "runtime", "compositor", "devices", "graphics" };
+    bool reconnecting = g_reconnecting;
+    EInitState state = PollInitThread(LUA);
+    LUA->PushString(reconnecting && state == InitState_Connecting ? "reconnecting" : stateNames[state]);
+    if (state == InitState_Failed)
+        LUA->PushString(g_initError);
+    else
+        LUA->PushNil();
+    // Stage times are written by the init thread, so only the elapsed time is reported
+    // while it is still connecting.
+    LUA->CreateTable();
+    double total = 0.0;
+    if (state == InitState_Connecting) {
+        total = InitClock() - g_initStartTime;
+    }
+    else {
+        for (int i = 0; i < InitStage_Max; i++) {
+            LUA->PushNumber(g_initStageTimes[i]);
+            LUA->SetField(-2, stageNames[i]);
+            total += g_initStageTimes[i];
+        }
+    }
+    LUA->PushNumber(total);
+    LUA->SetField(-2, "total");
+    return 3;
+}
+
+LUA_FUNCTION(GetReconnectCount) {
+    LUA->PushNumber(g_reconnectCount);
+    return 1;
+}
+
+LUA_FUNCTION(UpdatePosesAndActions) {
+    if (g_reconnecting && PollInitThread(LUA) != InitState_Ready)
+        return 0;
+    // In loading mode the compositor shows the loading environment on its own, so don't
+    // let it pace the game; just keep poses and input current.
+    if (g_loadingMode) {
+        g_pSystem->GetDeviceToAbsoluteTrackingPose(vr::TrackingUniverseStanding, 0.0f, g_poses, vr::k_unMaxTrackedDeviceCount);
+        ProcessEvents();
+        if (g_quitPending) {
+            BeginReconnect(false);
+            return 0;
+        }
+        g_pInput->UpdateActionState(g_activeActionSets, sizeof(vr::VRActiveActionSet_t), g_activeActionSetCount);
+        return 0;
+    }
+    // Running start: with the compositor already released by PostPresentHandoff, delay the
+    // pose wait until waitLead seconds before vsync so poses are sampled later.
+    double now = InitClock();
+    g_frameStats.sleep = 0.0f;
+    if (g_runningStart && g_waitLead > 0.0f && !g_waitStalled) {
+        float remaining = vr::VRCompositor()->GetFrameTimeRemaining();
+        float period = 1.0f / g_displayFrequency;
+        if (remaining > g_waitLead && remaining < period) {
+            std::this_thread::sleep_for(std::chrono::duration<float>(remaining - g_waitLead));
+            g_frameStats.sleep = (float)(InitClock() - now);
+            now = InitClock();
+        }
+    }
+    if (g_frameStats.submitTime > g_frameStats.waitEnd)
+        g_frameStats.submitToWait = (float)(now - g_frameStats.submitTime);
+    g_frameStats.waitStart = now;
+    // A wait still stuck after the watchdog was disabled has to finish on its thread.
+    if (!g_waitWatchdog && g_waitThread.joinable() && !WaitThreadBusy())
+        StopWaitThread();
+    vr::EVRCompositorError waitError;
+    if (g_waitWatchdog || g_waitThread.joinable())
+        waitError = WaitGetPosesWatchdog();
+    else
+        waitError = vr::VRCompositor()->WaitGetPoses(g_poses, vr::k_unMaxTrackedDeviceCount, NULL, 0);
+    if (waitError == vr::VRCompositorError_RequestFailed) {
+        BeginReconnect(true);
+        return 0;
+    }
+    now = InitClock();
+    g_frameStats.wait = (float)(now - g_frameStats.waitStart);
+    if (g_frameStats.waitEnd > 0.0)
+        g_frameStats.frameInterval = (float)(now - g_frameStats.waitEnd);
+    g_frameStats.waitEnd = now;
+    g_frameStats.frames++;
+    UpdateFrameTiming();
+    if (!g_waitStalled) {
+        g_frameStats.droppedFrames += g_frameTiming.m_nNumDroppedFrames;
+        g_frameStats.misPresented += g_frameTiming.m_nNumMisPresented;
+        if (g_reprojection.enabled)
+            UpdateReprojection();
+    }
+    if (g_poseHistoryCapacity > 0) {
+        for (unsigned int i = 0; i < vr::k_unMaxTrackedDeviceCount; i++)
+            RecordPoseHistory(i, g_poses[i]);
+    }
+    ProcessEvents();
+    if (g_quitPending && !g_waitStalled) {
+        BeginReconnect(false);
+        return 0;
+    }
+    if (g_renderSuspension && !g_waitStalled)
+        UpdateRenderState();
+    g_pInput->UpdateActionState(g_activeActionSets, sizeof(vr::VRActiveActionSet_t), g_activeActionSetCount);
+    return 0;
+}
+
+// Writes a 3x4 transform into a VMatrix userdata, filling in the bottom row.
+void WriteVMatrix(GarrysMod::Lua::ILuaBase* LUA, int iStackPos, const float m[3][4]) {
+    float* dst = LUA->GetUserType<float>(iStackPos, GarrysMod::Lua::Type::MATRIX);
+    if (dst == NULL)
+        return;
+    memcpy(dst, m, sizeof(float) * 12);
+    dst[12] = 0.0f;
+    dst[13] = 0.0f;
+    dst[14] = 0.0f;
+    dst[15] = 1.0f;
+}
+
+void PushNewMatrix(GarrysMod::Lua::ILuaBase* LUA) {
+    LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+    LUA->GetField(-1, "Matrix");
+    LUA->Call(0, 1);
+    LUA->Remove(-2);
+}
+
+// Pushes the VMatrix stored in field name of the table on top of the stack, creating it
+// with the global Matrix() the first time so the same object is reused every frame.
+void PushReusableMatrix(GarrysMod::Lua::ILuaBase* LUA, const char* name) {
+    LUA->GetField(-1, name);
+    if (LUA->IsType(-1, GarrysMod::Lua::Type::MATRIX))
+        return;
+    LUA->Pop(1);
+    PushNewMatrix(LUA);
+    LUA->Push(-1);
+    LUA->SetField(-3, name);
+}
+
+void PushPoseFields(GarrysMod::Lua::ILuaBase* LUA, const poseData& pose) {
+    LUA->PushVector(pose.pos);
+    LUA->SetField(-2, "pos");
+    LUA->PushVector(pose.vel);
+    LUA->SetField(-2, "vel");
+    if (g_poseOutputEuler) {
+        LUA->PushAngle(pose.ang);
+        LUA->SetField(-2, "ang");
+    }
+    LUA->PushAngle(pose.angvel);
+    LUA->SetField(-2, "angvel");
+    if (g_poseOutputQuat) {
+        LUA->GetField(-1, "quat");
+        if (!LUA->IsType(-1, GarrysMod::Lua::Type::TABLE)) {
+            LUA->Pop(1);
+            LUA->CreateTable();
+            LUA->Push(-1);
+            LUA->SetField(-3, "quat");
+        }
+        LUA->PushNumber(pose.quat[0]);
+        LUA->SetField(-2, "x");
+        LUA->PushNumber(pose.quat[1]);
+        LUA->SetField(-2, "y");
+        LUA->PushNumber(pose.quat[2]);
+        LUA->SetField(-2, "z");
+        LUA->PushNumber(pose.quat[3]);
+        LUA->SetField(-2, "w");
+        LUA->Pop(1);
+    }
+    if (g_poseOutputMatrix) {
+        PushReusableMatrix(LUA, "matrix");
+        WriteVMatrix(LUA, -1, pose.matrix);
+        LUA->Pop(1);
+    }
+}
+
+LUA_FUNCTION(SetPoseOutputMode) {
+    g_poseOutputEuler = LUA->GetBool(1);
+    g_poseOutputQuat = LUA->GetBool(2);
+    g_poseOutputMatrix = LUA->GetBool(3);
+    g_poseOutputWorld = LUA->GetBool(4);
+    return 0;
+}
+
+// Stores the origin in OpenVR axes so ConvertPoses can apply it before the axis swizzle:
+// vr x = -source y, vr y = source z, vr z = -source x.
+LUA_FUNCTION(SetTrackingOrigin) {
+    Vector pos = LUA->GetVector(1);
+    QAngle ang = LUA->GetAngle(2);
+    float scale = LUA->IsType(3, GarrysMod::Lua::Type::NUMBER) ? (float)LUA->GetNumber(3) : 1.0f;
+    static const int axis[3] = { 1, 2, 0 };
+    static const float sign[3] = { -1.0f, 1.0f, -1.0f };
+    float q[4], rot[3][4];
+    AngleToQuat(ang, q);
+    QuatToMatrix(q, rot);
+    const float origin[3] = { pos.x, pos.y, pos.z };
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++)
+            g_trackingOrigin[i][j] = sign[i] * sign[j] * rot[axis[i]][axis[j]];
+        g_trackingOrigin[i][3] = sign[i] * origin[axis[i]];
+    }
+    g_trackingScale = scale;
+    return 0;
+}
+
+// Blends between two OpenVR poses; position and velocities are lerped, rotation slerped.
+void BlendPoses(const vr::TrackedDevicePose_t& a, const vr::TrackedDevicePose_t& b, float t, vr::TrackedDevicePose_t* out) {
+    float qa[4], qb[4], q[4];
+    MatrixToQuat(a.mDeviceToAbsoluteTracking.m, qa);
+    MatrixToQuat(b.mDeviceToAbsoluteTracking.m, qb);
+    QuatSlerp(qa, qb, t, q);
+    *out = b;
+    QuatToMatrix(q, out->mDeviceToAbsoluteTracking.m);
+    for (int i = 0; i < 3; i++) {
+        out->mDeviceToAbsoluteTracking.m[i][3] = a.mDeviceToAbsoluteTracking.m[i][3] + (b.mDeviceToAbsoluteTracking.m[i][3] - a.mDeviceToAbsoluteTracking.m[i][3]) * t;
+        out->vVelocity.v[i] = a.vVelocity.v[i] + (b.vVelocity.v[i] - a.vVelocity.v[i]) * t;
+        out->vAngularVelocity.v[i] = a.vAngularVelocity.v[i] + (b.vAngularVelocity.v[i] - a.vAngularVelocity.v[i]) * t;
+    }
+}
+
+// While a pose is invalid or not Running_OK, extrapolates the last good pose from its
+// velocity and angular velocity for up to g_trackingHoldTime seconds with a confidence
+// falling from 1 to 0, then holds it. When tracking returns the output blends back to
+// the tracked pose over g_trackingBlendTime seconds.
+void ApplyTrackingLoss(trackingState* st, vr::TrackedDevicePose_t* pose) {
+    bool good = pose->bPoseIsValid && pose->eTrackingResult == vr::TrackingResult_Running_OK;
+    if (good) {
+        if (st->lost) {
+            st->lost = false;
+            st->recoverTime = g_frameTime;
+            st->blendFrom = st->output;
+            st->blendConfidence = st->confidence;
+        }
+        st->last = *pose;
+        st->hasLast = true;
+        st->confidence = 1.0f;
+        float t = g_trackingBlendTime > 0.0f ? (float)((g_frameTime - st->recoverTime) / g_trackingBlendTime) : 1.0f;
+        if (t < 1.0f) {
+            t = t * t * (3.0f - 2.0f * t);
+            BlendPoses(st->blendFrom, *pose, t, pose);
+            st->confidence = st->blendConfidence + (1.0f - st->blendConfidence) * t;
+        }
+        st->output = *pose;
+        return;
+    }
+    if (!st->hasLast) {
+        st->confidence = 0.0f;
+        return;
+    }
+    if (!st->lost) {
+        st->lost = true;
+        st->lostTime = g_frameTime;
+    }
+    float elapsed = (float)(g_frameTime - st->lostTime);
+    float dt = elapsed < g_trackingHoldTime ? elapsed : g_trackingHoldTime;
+    const vr::TrackedDevicePose_t& last = st->last;
+    float q[4], qOut[4];
+    Vector angvel;
+    angvel.x = last.vAngularVelocity.v[0] * (180.0f / PI_F);
+    angvel.y = last.vAngularVelocity.v[1] * (180.0f / PI_F);
+    angvel.z = last.vAngularVelocity.v[2] * (180.0f / PI_F);
+    MatrixToQuat(last.mDeviceToAbsoluteTracking.m, q);
+    QuatIntegrate(q, angvel, dt, qOut);
+    *pose = last;
+    QuatToMatrix(qOut, pose->mDeviceToAbsoluteTracking.m);
+    for (int i = 0; i < 3; i++)
+        pose->mDeviceToAbsoluteTracking.m[i][3] = last.mDeviceToAbsoluteTracking.m[i][3] + last.vVelocity.v[i] * dt;
+    pose->bPoseIsValid = true;
+    st->confidence = g_trackingHoldTime > 0.0f && elapsed < g_trackingHoldTime ? 1.0f - elapsed / g_trackingHoldTime : 0.0f;
+    st->output = *pose;
+}
+
+LUA_FUNCTION(SetTrackingLossHold) {
+    g_trackingHoldTime = (float)LUA->CheckNumber(1);
+    if (LUA->IsType(2, GarrysMod::Lua::Type::NUMBER))
+        g_trackingBlendTime = (float)LUA->GetNumber(2);
+    memset(g_trackingStates, 0, sizeof(g_trackingStates));
+    return 0;
+}
+
+void ClosePoseExport() {
+#ifndef _WIN32
+    if (g_poseExport.map == NULL)
+        return;
+    munmap(g_poseExport.map, sizeof(vrmodPoseExport));
+    unlink(g_poseExport.path);
+#endif
+    g_poseExport.map = NULL;
+}
+
+// Copies the staged update to the shared file under its sequence counter. Only the used
+// pose and action entries are copied.
+void PublishPoseExport() {
+    vrmodPoseExport* e = &g_poseExport.staging;
+    vrmodPoseExport* out = g_poseExport.map;
+    e->update++;
+    e->time = InitClock();
+    e->timing.waitEnd = g_frameStats.waitEnd;
+    e->timing.frameTime = g_frameTime;
+    e->timing.wait = g_frameStats.wait;
+    e->timing.sleep = g_frameStats.sleep;
+    e->timing.poseToSubmit = g_frameStats.poseToSubmit;
+    e->timing.submitToWait = g_frameStats.submitToWait;
+    e->timing.frameInterval = g_frameStats.frameInterval;
+    e->timing.displayFrequency = g_displayFrequency;
+    e->timing.frames = g_frameStats.frames;
+    e->timing.droppedFrames = g_frameStats.droppedFrames;
+    e->timing.misPresented = g_frameStats.misPresented;
+    uint32_t sequence = out->sequence;
+    __atomic_store_n(&out->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&out->update, &e->update, offsetof(vrmodPoseExport, poses) - offsetof(vrmodPoseExport, update));
+    memcpy(out->poses, e->poses, e->poseCount * sizeof(vrmodPose));
+    memcpy(out->actions, e->actions, e->actionCount * sizeof(vrmodAction));
+    __atomic_store_n(&out->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+// Stages the hmd and every pose action, valid or not, so entries keep their index between
+// updates. Uses the same axes and world transform as GetPoses regardless of its output mode.
+void StageExportPoses() {
+    vrmodPoseExport* e = &g_poseExport.staging;
+    int count = 0;
+    for (int slot = 0; slot <= g_actionCount && count < VRMOD_MAX_POSES; slot++) {
+        if (slot > 0 && g_actions[slot - 1].type != ActionType_Pose)
+            continue;
+        const vr::TrackedDevicePose_t& pose = g_lastPoses[slot];
+        vrmodPose* p = &e->poses[count++];
+        snprintf(p->name, sizeof(p->name), "%s", slot == 0 ? "hmd" : g_actions[slot - 1].name);
+        p->valid = pose.bPoseIsValid;
+        vr::HmdMatrix34_t mat = pose.mDeviceToAbsoluteTracking;
+        vr::HmdVector3_t vel = pose.vVelocity;
+        vr::HmdVector3_t angvel = pose.vAngularVelocity;
+        if (g_poseOutputWorld) {
+            TransformToWorld(pose.mDeviceToAbsoluteTracking, &mat);
+            RotateToWorld(pose.vVelocity, g_trackingScale, &vel);
+            RotateToWorld(pose.vAngularVelocity, 1.0f, &angvel);
+        }
+        float m[3][4];
+        PoseToSourceMatrix(mat, m);
+        MatrixToQuat(m, p->quat);
+        p->pos[0] = -mat.m[2][3];
+        p->pos[1] = -mat.m[0][3];
+        p->pos[2] = mat.m[1][3];
+        p->vel[0] = -vel.v[2];
+        p->vel[1] = -vel.v[0];
+        p->vel[2] = vel.v[1];
+        p->angvel[0] = -angvel.v[2] * (180.0f / PI_F);
+        p->angvel[1] = -angvel.v[0] * (180.0f / PI_F);
+        p->angvel[2] = angvel.v[1] * (180.0f / PI_F);
+    }
+    e->poseCount = count;
+}
+
+void StageExportAction(int* count, const char* name, uint32_t type, bool state, float x, float y) {
+    if (*count >= VRMOD_MAX_ACTIONS)
+        return;
+    vrmodAction* a = &g_poseExport.staging.actions[(*count)++];
+    snprintf(a->name, sizeof(a->name), "%s", name);
+    a->type = type;
+    a->state = state;
+    a->x = x;
+    a->y = y;
+}
+
+#ifndef _WIN32
+// Creates /dev/shm/<name> afresh, so readers still mapping an older file are unaffected.
+const char* OpenPoseExport(const char* name) {
+    snprintf(g_poseExport.path, sizeof(g_poseExport.path), "/dev/shm/%s", name);
+    unlink(g_poseExport.path);
+    int fd = open(g_poseExport.path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1)
+        return "VRMOD: failed to create the pose export in /dev/shm";
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, sizeof(vrmodPoseExport)) == 0)
+        map = mmap(NULL, sizeof(vrmodPoseExport), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        unlink(g_poseExport.path);
+        return "VRMOD: failed to map the pose export";
+    }
+    memset(&g_poseExport.staging, 0, sizeof(g_poseExport.staging));
+    g_poseExport.map = (vrmodPoseExport*)map;
+    g_poseExport.map->version = VRMOD_POSES_VERSION;
+    g_poseExport.map->size = sizeof(vrmodPoseExport);
+    __atomic_store_n(&g_poseExport.map->magic, VRMOD_POSES_MAGIC, __ATOMIC_RELEASE);
+    return NULL;
+}
+#endif
+
+LUA_FUNCTION(SetPoseExport) {
+    bool enable = LUA->GetBool(1);
+    ClosePoseExport();
+    if (!enable) {
+        LUA->PushBool(true);
+        return 1;
+    }
+#ifdef _WIN32
+    LUA->PushBool(false);
+    LUA->PushString("VRMOD: pose export is only available on Linux");
+    return 2;
+#else
+    const char* name = LUA->IsType(2, GarrysMod::Lua::Type::STRING) ? LUA->GetString(2) : "vrmod_poses";
+    if (name[0] == '\0' || strchr(name, '/') != NULL)
+        LUA->ThrowError("VRMOD: invalid pose export name");
+    const char* error = OpenPoseExport(name);
+    if (error != NULL) {
+        LUA->PushBool(false);
+        LUA->PushString(error);
+        return 2;
+    }
+    LUA->PushBool(true);
+    return 1;
+#endif
+}
+
+LUA_FUNCTION(GetPoses) {
+    if (g_reconnecting) {
+        LUA->ReferencePush(g_luaRefs[LuaRefIndex_PoseTable]);
+        return 1;
+    }
+    vr::InputPoseActionData_t poseActionData[MAX_ACTIONS];
+    vr::TrackedDevicePose_t hmdPose = g_poses[0];
+    const vr::TrackedDevicePose_t* poses[MAX_ACTIONS + 1] = {};
+    const char* poseNames[MAX_ACTIONS + 1];
+    int poseRefs[MAX_ACTIONS + 1];
+    int poseSlots[MAX_ACTIONS + 1];
+    poseData converted[MAX_ACTIONS + 1];
+    int poseCount = 0;
+    float secondsToPhotons = 0.0f;
+    if (g_poseNextFrame) {
+        float secondsSinceVsync = 0.0f;
+        g_pSystem->GetTimeSinceLastVsync(&secondsSinceVsync, NULL);
+        secondsToPhotons = 1.0f / g_displayFrequency - secondsSinceVsync + g_vsyncToPhotons;
+    }
+    if (g_trackingHoldTime > 0.0f)
+        ApplyTrackingLoss(&g_trackingStates[0], &hmdPose);
+    g_lastPoses[0] = hmdPose;
+    if (hmdPose.bPoseIsValid) {
+        poses[poseCount] = &hmdPose;
+        poseNames[poseCount] = "hmd";
+        poseRefs[poseCount] = g_luaRefs[LuaRefIndex_HmdPose];
+        poseSlots[poseCount] = 0;
+        poseCount++;
+    }
+    for (int i = 0; i < g_actionCount; i++) {
+        if (g_actions[i].type != ActionType_Pose)
+            continue;
+        if (g_poseNextFrame && g_actions[i].predictionOffset == 0.0f)
+            g_pInput->GetPoseActionDataForNextFrame(g_actions[i].handle, vr::TrackingUniverseStanding, &poseActionData[i], sizeof(poseActionData[i]), vr::k_ulInvalidInputValueHandle);
+        else
+            g_pInput->GetPoseActionDataRelativeToNow(g_actions[i].handle, vr::TrackingUniverseStanding, (g_poseNextFrame ? secondsToPhotons : 0.0f) + g_actions[i].predictionOffset, &poseActionData[i], sizeof(poseActionData[i]), vr::k_ulInvalidInputValueHandle);
+        if (g_trackingHoldTime > 0.0f)
+            ApplyTrackingLoss(&g_trackingStates[i + 1], &poseActionData[i].pose);
+        if (g_actions[i].filter.enabled && poseActionData[i].pose.bPoseIsValid)
+            FilterPose(&g_actions[i].filter, &poseActionData[i].pose);
+        g_lastPoses[i + 1] = poseActionData[i].pose;
+        if (g_poseHistoryCapacity > 0)
+            RecordPoseHistory(vr::k_unMaxTrackedDeviceCount + i, poseActionData[i].pose);
+        if (poseActionData[i].pose.bPoseIsValid) {
+            poses[poseCount] = &poseActionData[i].pose;
+            poseNames[poseCount] = g_actions[i].name;
+            poseRefs[poseCount] = g_actions[i].luaRefs[0];
+            poseSlots[poseCount] = i + 1;
+            poseCount++;
+        }
+    }
+    ConvertPoses(poses, converted, poseCount);
+    LUA->ReferencePush(g_luaRefs[LuaRefIndex_PoseTable]);
+    for (int i = 0; i < poseCount; i++) {
+        LUA->ReferencePush(poseRefs[i]);
+        PushPoseFields(LUA, converted[i]);
+        if (g_trackingHoldTime > 0.0f) {
+            LUA->PushNumber(g_trackingStates[poseSlots[i]].confidence);
+            LUA->SetField(-2, "confidence");
+        }
+        LUA->SetField(-2, poseNames[i]);
+    }
+    if (g_poseExport.map != NULL) {
+        StageExportPoses();
+        PublishPoseExport();
+    }
+    return 1;
+}
+
+LUA_FUNCTION(GetDevicePoses) {
+    unsigned int classMask = LUA->IsType(1, GarrysMod::Lua::Type::NUMBER) ? (unsigned int)LUA->GetNumber(1) : 0xFFFFFFFF;
+    int deviceClasses[vr::k_unMaxTrackedDeviceCount];
+    {
+        std::lock_guard<std::mutex> lock(g_deviceMutex);
+        for (unsigned int i = 0; i < vr::k_unMaxTrackedDeviceCount; i++)
+            deviceClasses[i] = g_devices[i].connected ? g_devices[i].deviceClass : vr::TrackedDeviceClass_Invalid;
+    }
+    const vr::TrackedDevicePose_t* poses[vr::k_unMaxTrackedDeviceCount];
+    unsigned int deviceIndices[vr::k_unMaxTrackedDeviceCount];
+    poseData converted[vr::k_unMaxTrackedDeviceCount];
+    int poseCount = 0;
+    for (unsigned int i = 0; i < vr::k_unMaxTrackedDeviceCount; i++) {
+        if (g_poses[i].bPoseIsValid && deviceClasses[i] != vr::TrackedDeviceClass_Invalid && (classMask & (1u << deviceClasses[i]))) {
+            poses[poseCount] = &g_poses[i];
+            deviceIndices[poseCount] = i;
+            poseCount++;
+        }
+    }
+    ConvertPoses(poses, converted, poseCount);
+    LUA->ReferencePush(g_luaRefs[LuaRefIndex_DevicePoseTable]);
+    for (unsigned int i = 0, j = 0; i < vr::k_unMaxTrackedDeviceCount; i++) {
+        LUA->PushNumber(i);
+        if (j < (unsigned int)poseCount && deviceIndices[j] == i) {
+            LUA->ReferencePush(g_devicePoseLuaRefs[i]);
+            PushPoseFields(LUA, converted[j]);
+            LUA->PushNumber(deviceClasses[i]);
+            LUA->SetField(-2, "class");
+            j++;
+        }
+        else {
+            LUA->PushNil();
+        }
+        LUA->SetTable(-3);
+    }
+    return 1;
+}
+
+LUA_FUNCTION(SetPoseSampling) {
+    g_poseNextFrame = LUA->GetBool(1);
+    return 0;
+}
+
+LUA_FUNCTION(SetPosePrediction) {
+    int actionIndex = FindAction(LUA->CheckString(1));
+    if (actionIndex == -1 || g_actions[actionIndex].type != ActionType_Pose)
+        LUA->ThrowError("VRMOD: SetPosePrediction unknown pose action");
+    g_actions[actionIndex].predictionOffset = (float)LUA->CheckNumber(2);
+    return 0;
+}
+
+LUA_FUNCTION(SetPoseHistory) {
+    float seconds = (float)LUA->CheckNumber(1);
+    int capacity = seconds > 0.0f ? (int)ceilf(seconds * g_displayFrequency) + 1 : 0;
+    free(g_poseHistoryBuffer);
+    g_poseHistoryBuffer = capacity > 0 ? (historySample*)calloc((size_t)capacity * HISTORY_TRACKS, sizeof(historySample)) : NULL;
+    g_poseHistoryCapacity = g_poseHistoryBuffer != NULL ? capacity : 0;
+    ResetPoseHistory();
+    return 0;
+}
+
+LUA_FUNCTION(GetFrameTime) {
+    LUA->PushNumber(g_frameTime);
+    return 1;
+}
+
+// Pushes the pose of a device index or pose action name at the given frame time, linearly
+// interpolating position and slerping rotation between the bracketing samples.
+LUA_FUNCTION(GetPoseAt) {
+    int track = -1;
+    if (LUA->IsType(1, GarrysMod::Lua::Type::NUMBER)) {
+        track = (int)LUA->GetNumber(1);
+        if (track < 0 || track >= (int)vr::k_unMaxTrackedDeviceCount)
+            track = -1;
+    }
+    else {
+        const char* name = LUA->CheckString(1);
+        int actionIndex = FindAction(name);
+        if (strcmp(name, "hmd") == 0)
+            track = vr::k_unTrackedDeviceIndex_Hmd;
+        else if (actionIndex != -1 && g_actions[actionIndex].type == ActionType_Pose)
+            track = vr::k_unMaxTrackedDeviceCount + actionIndex;
+    }
+    double time = LUA->CheckNumber(2);
+    if (track == -1 || g_poseHistoryCapacity == 0)
+        return 0;
+    const poseHistory* h = &g_poseHistory[track];
+    const historySample* a = NULL;
+    const historySample* b = NULL;
+    int lo = 0, hi = h->count;
+    int first = (h->head + g_poseHistoryCapacity - h->count) % g_poseHistoryCapacity;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (h->samples[(first + mid) % g_poseHistoryCapacity].time <= time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (int i = lo - 1; i >= 0 && a == NULL; i--) {
+        if (h->samples[(first + i) % g_poseHistoryCapacity].valid)
+            a = &h->samples[(first + i) % g_poseHistoryCapacity];
+    }
+    for (int i = lo; i < h->count && b == NULL; i++) {
+        if (h->samples[(first + i) % g_poseHistoryCapacity].valid)
+            b = &h->samples[(first + i) % g_poseHistoryCapacity];
+    }
+    if (a == NULL && b == NULL)
+        return 0;
+    float ma[3][4], mb[3][4], qa[4], qb[4], q[4];
+    PoseToSourceMatrix((a != NULL ? a : b)->mat, ma);
+    PoseToSourceMatrix((b != NULL ? b : a)->mat, mb);
+    MatrixToQuat(ma, qa);
+    MatrixToQuat(mb, qb);
+    float t = 0.0f;
+    if (a != NULL && b != NULL && b->time > a->time)
+        t = (float)((time - a->time) / (b->time - a->time));
+    Vector pos;
+    QAngle ang;
+    pos.x = ma[0][3] + (mb[0][3] - ma[0][3]) * t;
+    pos.y = ma[1][3] + (mb[1][3] - ma[1][3]) * t;
+    pos.z = ma[2][3] + (mb[2][3] - ma[2][3]) * t;
+    QuatSlerp(qa, qb, t, q);
+    QuatToAngle(q, ang);
+    LUA->PushVector(pos);
+    LUA->PushAngle(ang);
+    return 2;
+}
+
+LUA_FUNCTION(GetPoseKernel) {
+    LUA->PushString(g_eulerBatchName);
+    return 1;
+}
+
+void WriteBits(bitWriter* w, uint32_t value, int bits) {
+    w->acc |= (uint64_t)(value & (uint32_t)((1ull << bits) - 1)) << w->accBits;
+    w->accBits += bits;
+    while (w->accBits >= 8) {
+        if (w->size < w->capacity)
+            w->data[w->size++] = (uint8_t)w->acc;
+        w->acc >>= 8;
+        w->accBits -= 8;
+    }
+}
+
+void FlushBits(bitWriter* w) {
+    if (w->accBits > 0)
+        WriteBits(w, 0, 8 - w->accBits);
+}
+
+uint32_t ReadBits(bitReader* r, int bits) {
+    while (r->accBits < bits) {
+        if (r->pos < r->size) {
+            r->acc |= (uint64_t)r->data[r->pos++] << r->accBits;
+        }
+        else {
+            r->overrun = true;
+        }
+        r->accBits += 8;
+    }
+    uint32_t value = (uint32_t)(r->acc & ((1ull << bits) - 1));
+    r->acc >>= bits;
+    r->accBits -= bits;
+    return value;
+}
+
+// Smallest-three quaternion: 2 bits for the index of the largest component, which is
+// made positive and dropped, then the other three quantized over +-1/sqrt(2).
+uint64_t QuantizeQuat(const float q[4]) {
+    int largest = 0;
+    for (int i = 1; i < 4; i++) {
+        if (fabsf(q[i]) > fabsf(q[largest]))
+            largest = i;
+    }
+    float sign = q[largest] < 0.0f ? -1.0f : 1.0f;
+    const float maxValue = (float)((1 << CODEC_ROT_BITS) - 1);
+    uint64_t packed = (uint64_t)largest;
+    int shift = 2;
+    for (int i = 0; i < 4; i++) {
+        if (i == largest)
+            continue;
+        float v = (q[i] * sign + 0.70710678f) / 1.41421356f;
+        v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+        packed |= (uint64_t)(v * maxValue + 0.5f) << shift;
+        shift += CODEC_ROT_BITS;
+    }
+    return packed;
+}
+
+void DequantizeQuat(uint64_t packed, float q[4]) {
+    int largest = (int)(packed & 3);
+    const float maxValue = (float)((1 << CODEC_ROT_BITS) - 1);
+    float sum = 0.0f;
+    int shift = 2;
+    for (int i = 0; i < 4; i++) {
+        if (i == largest)
+            continue;
+        q[i] = (float)((packed >> shift) & ((1 << CODEC_ROT_BITS) - 1)) / maxValue * 1.41421356f - 0.70710678f;
+        sum += q[i] * q[i];
+        shift += CODEC_ROT_BITS;
+    }
+    q[largest] = sqrtf(sum < 1.0f ? 1.0f - sum : 0.0f);
+}
+
+// Returns false if value is out of the +-32 m range that fits in 16 bits.
+bool QuantizePosition(float value, int16_t* out) {
+    float scaled = value * CODEC_POS_SCALE;
+    if (!(scaled >= -32767.0f && scaled <= 32767.0f))
+        return false;
+    *out = (int16_t)lrintf(scaled);
+    return true;
+}
+
+void EncodeFrame(bitWriter* w, const codecFrame* frame, const codecFrame* baseline) {
+    WriteBits(w, CODEC_VERSION, 8);
+    WriteBits(w, frame->seq, 16);
+    WriteBits(w, baseline != NULL, 1);
+    if (baseline != NULL)
+        WriteBits(w, baseline->seq, 16);
+    WriteBits(w, frame->slotCount, 5);
+    for (int i = 0; i < frame->slotCount; i++) {
+        const codecPose& pose = frame->slots[i];
+        WriteBits(w, pose.valid, 1);
+        if (!pose.valid)
+            continue;
+        const codecPose* base = (baseline != NULL && i < baseline->slotCount && baseline->slots[i].valid) ? &baseline->slots[i] : NULL;
+        int delta[3] = { 0, 0, 0 };
+        bool small = base != NULL;
+        for (int j = 0; j < 3 && base != NULL; j++) {
+            delta[j] = pose.pos[j] - base->pos[j];
+            if (delta[j] < -128 || delta[j] > 127)
+                small = false;
+        }
+        if (base != NULL && delta[0] == 0 && delta[1] == 0 && delta[2] == 0) {
+            WriteBits(w, 0, 2);
+        }
+        else if (small) {
+            WriteBits(w, 1, 2);
+            for (int j = 0; j < 3; j++)
+                WriteBits(w, (uint32_t)delta[j], 8);
+        }
+        else {
+            WriteBits(w, 2, 2);
+            for (int j = 0; j < 3; j++)
+                WriteBits(w, (uint16_t)pose.pos[j], 16);
+        }
+        if (base != NULL && base->rot == pose.rot) {
+            WriteBits(w, 0, 1);
+        }
+        else {
+            WriteBits(w, 1, 1);
+            WriteBits(w, (uint32_t)(pose.rot & 0xFFFFFFFF), 32);
+            WriteBits(w, (uint32_t)(pose.rot >> 32), 2 + 3 * CODEC_ROT_BITS - 32);
+        }
+    }
+    FlushBits(w);
+}
+
+// Returns false if the data is malformed or references a baseline that is not in history.
+bool DecodeFrame(bitReader* r, codecFrame* frame, const codecFrame* history) {
+    if (ReadBits(r, 8) != CODEC_VERSION)
+        return false;
+    frame->seq = (uint16_t)ReadBits(r, 16);
+    const codecFrame* baseline = NULL;
+    if (ReadBits(r, 1)) {
+        uint16_t baselineSeq = (uint16_t)ReadBits(r, 16);
+        baseline = &history[baselineSeq % CODEC_HISTORY];
+        if (!baseline->used || baseline->seq != baselineSeq)
+            return false;
+    }
+    frame->slotCount = (int)ReadBits(r, 5);
+    if (frame->slotCount > MAX_CODEC_SLOTS)
+        return false;
+    for (int i = 0; i < frame->slotCount; i++) {
+        codecPose& pose = frame->slots[i];
+        pose.valid = ReadBits(r, 1) != 0;
+        if (!pose.valid)
+            continue;
+        const codecPose* base = (baseline != NULL && i < baseline->slotCount && baseline->slots[i].valid) ? &baseline->slots[i] : NULL;
+        uint32_t posMode = ReadBits(r, 2);
+        if (posMode == 2) {
+            for (int j = 0; j < 3; j++)
+                pose.pos[j] = (int16_t)(uint16_t)ReadBits(r, 16);
+        }
+        else if (base != NULL && posMode != 3) {
+            for (int j = 0; j < 3; j++)
+                pose.pos[j] = base->pos[j] + (posMode == 1 ? (int8_t)(uint8_t)ReadBits(r, 8) : 0);
+        }
+        else {
+            return false;
+        }
+        if (ReadBits(r, 1)) {
+            pose.rot = ReadBits(r, 32);
+            pose.rot |= (uint64_t)ReadBits(r, 2 + 3 * CODEC_ROT_BITS - 32) << 32;
+        }
+        else if (base != NULL) {
+            pose.rot = base->rot;
+        }
+        else {
+            return false;
+        }
+    }
+    frame->used = true;
+    return !r->overrun;
+}
+
+LUA_FUNCTION(EncodePoses) {
+    LUA->CheckType(1, GarrysMod::Lua::Type::Vector);
+    Vector origin = LUA->GetVector(1);
+    const codecFrame* baseline = NULL;
+    if (LUA->IsType(2, GarrysMod::Lua::Type::NUMBER)) {
+        uint16_t baselineSeq = (uint16_t)LUA->GetNumber(2);
+        const codecFrame* candidate = &g_codecHistory[baselineSeq % CODEC_HISTORY];
+        if (candidate->used && candidate->seq == baselineSeq)
+            baseline = candidate;
+    }
+    g_codecSeq++;
+    codecFrame* frame = &g_codecHistory[g_codecSeq % CODEC_HISTORY];
+    if (frame == baseline)
+        baseline = NULL;
+    frame->used = true;
+    frame->seq = g_codecSeq;
+    frame->slotCount = 0;
+    for (int i = -1; i < g_actionCount && frame->slotCount < MAX_CODEC_SLOTS; i++) {
+        if (i != -1 && g_actions[i].type != ActionType_Pose)
+            continue;
+        const vr::TrackedDevicePose_t& pose = g_lastPoses[i + 1];
+        codecPose& slot = frame->slots[frame->slotCount++];
+        slot.valid = pose.bPoseIsValid;
+        if (!slot.valid)
+            continue;
+        float m[3][4];
+        float q[4];
+        PoseToSourceMatrix(pose.mDeviceToAbsoluteTracking, m);
+        MatrixToQuat(m, q);
+        // A pose too far from origin is sent as invalid rather than clamped to the wrong spot.
+        slot.valid = QuantizePosition(m[0][3] - origin.x, &slot.pos[0]) &&
+                     QuantizePosition(m[1][3] - origin.y, &slot.pos[1]) &&
+                     QuantizePosition(m[2][3] - origin.z, &slot.pos[2]);
+        slot.rot = QuantizeQuat(q);
+    }
+    uint8_t buffer[8 + MAX_CODEC_SLOTS * 16];
+    bitWriter w = { buffer, 0, sizeof(buffer), 0, 0 };
+    EncodeFrame(&w, frame, baseline);
+    LUA->PushString((const char*)buffer, w.size);
+    LUA->PushNumber(frame->seq);
+    return 2;
+}
+
+codecPeer* FindCodecPeer(int id, bool create) {
+    codecPeer* freePeer = NULL;
+    for (int i = 0; i < MAX_CODEC_PEERS; i++) {
+        if (g_codecPeers[i].used && g_codecPeers[i].id == id)
+            return &g_codecPeers[i];
+        if (!g_codecPeers[i].used && freePeer == NULL)
+            freePeer = &g_codecPeers[i];
+    }
+    if (!create || freePeer == NULL)
+        return NULL;
+    memset(freePeer, 0, sizeof(codecPeer));
+    freePeer->used = true;
+    freePeer->id = id;
+    return freePeer;
+}
+
+LUA_FUNCTION(DecodePoses) {
+    int id = (int)LUA->CheckNumber(1);
+    unsigned int size = 0;
+    const char* data = LUA->GetString(2, &size);
+    if (data == NULL)
+        LUA->ThrowError("VRMOD: DecodePoses expects a string");
+    LUA->CheckType(3, GarrysMod::Lua::Type::Vector);
+    Vector origin = LUA->GetVector(3);
+    codecPeer* peer = FindCodecPeer(id, true);
+    if (peer == NULL)
+        LUA->ThrowError("VRMOD: DecodePoses too many peers");
+    codecFrame frame;
+    bitReader r = { (const uint8_t*)data, size, 0, 0, 0, false };
+    if (!DecodeFrame(&r, &frame, peer->history))
+        return 0;
+    peer->history[frame.seq % CODEC_HISTORY] = frame;
+    LUA->CreateTable();
+    for (int i = 0; i < frame.slotCount; i++) {
+        if (!frame.slots[i].valid)
+            continue;
+        float q[4];
+        DequantizeQuat(frame.slots[i].rot, q);
+        Vector pos;
+        pos.x = origin.x + frame.slots[i].pos[0] / CODEC_POS_SCALE;
+        pos.y = origin.y + frame.slots[i].pos[1] / CODEC_POS_SCALE;
+        pos.z = origin.z + frame.slots[i].pos[2] / CODEC_POS_SCALE;
+        QAngle ang;
+        QuatToAngle(q, ang);
+        LUA->PushNumber(i + 1);
+        LUA->CreateTable();
+        LUA->PushVector(pos);
+        LUA->SetField(-2, "pos");
+        LUA->PushAngle(ang);
+        LUA->SetField(-2, "ang");
+        LUA->SetTable(-3);
+    }
+    LUA->PushNumber(frame.seq);
+    return 2;
+}
+
+LUA_FUNCTION(ResetPoseCodec) {
+    if (LUA->IsType(1, GarrysMod::Lua::Type::NUMBER)) {
+        codecPeer* peer = FindCodecPeer((int)LUA->GetNumber(1), false);
+        if (peer != NULL)
+            peer->used = false;
+    }
+    else {
+        memset(g_codecHistory, 0, sizeof(g_codecHistory));
+        memset(g_codecPeers, 0, sizeof(g_codecPeers));
+    }
+    return 0;
+}
+
+remotePlayer* FindRemotePlayer(int id, bool create) {
+    remotePlayer* freePlayer = NULL;
+    for (int i = 0; i < MAX_REMOTE_PLAYERS; i++) {
+        if (g_remotePlayers[i].used && g_remotePlayers[i].id == id)
+            return &g_remotePlayers[i];
+        if (!g_remotePlayers[i].used && freePlayer == NULL)
+            freePlayer = &g_remotePlayers[i];
+    }
+    if (!create || freePlayer == NULL)
+        return NULL;
+    *freePlayer = remotePlayer();
+    freePlayer->used = true;
+    freePlayer->id = id;
+    return freePlayer;
+}
+
+// Samples are kept sorted by time so late packets still land in the right place.
+void InsertRemoteSample(remotePose* pose, const remoteSample& sample) {
+    if (pose->sampleCount == REMOTE_BUFFER_SIZE) {
+        if (sample.time <= pose->samples[0].time)
+            return;
+        memmove(&pose->samples[0], &pose->samples[1], sizeof(remoteSample) * (REMOTE_BUFFER_SIZE - 1));
+        pose->sampleCount--;
+    }
+    int i = pose->sampleCount;
+    while (i > 0 && pose->samples[i - 1].time > sample.time) {
+        pose->samples[i] = pose->samples[i - 1];
+        i--;
+    }
+    if (i > 0 && pose->samples[i - 1].time == sample.time) {
+        memmove(&pose->samples[i], &pose->samples[i + 1], sizeof(remoteSample) * (pose->sampleCount - i));
+        pose->samples[i - 1] = sample;
+        return;
+    }
+    pose->samples[i] = sample;
+    pose->sampleCount++;
+}
+
+// Hermite interpolation of position using the sample velocities and slerp of rotation
+// between the bracketing samples. Past the newest sample the pose is extrapolated from
+// its velocity and angular velocity for at most g_remoteMaxExtrapolation seconds.
+void SampleRemotePose(const remotePose* pose, double time, Vector& pos, float quat[4]) {
+    const remoteSample* samples = pose->samples;
+    int count = pose->sampleCount;
+    if (count == 1 || time >= samples[count - 1].time) {
+        const remoteSample& s = samples[count - 1];
+        float dt = (float)(time - s.time);
+        dt = dt < 0.0f ? 0.0f : (dt > g_remoteMaxExtrapolation ? g_remoteMaxExtrapolation : dt);
+        pos.x = s.pos.x + s.vel.x * dt;
+        pos.y = s.pos.y + s.vel.y * dt;
+        pos.z = s.pos.z + s.vel.z * dt;
+        QuatIntegrate(s.quat, s.angvel, dt, quat);
+        return;
+    }
+    if (time <= samples[0].time) {
+        pos = samples[0].pos;
+        memcpy(quat, samples[0].quat, sizeof(float) * 4);
+        return;
+    }
+    int i = 1;
+    while (samples[i].time < time)
+        i++;
+    const remoteSample& a = samples[i - 1];
+    const remoteSample& b = samples[i];
+    float dt = (float)(b.time - a.time);
+    float t = (float)(time - a.time) / dt;
+    float t2 = t * t, t3 = t2 * t;
+    float h00 = 2.0f * t3 - 3.0f * t2 + 1.0f;
+    float h10 = (t3 - 2.0f * t2 + t) * dt;
+    float h01 = -2.0f * t3 + 3.0f * t2;
+    float h11 = (t3 - t2) * dt;
+    pos.x = h00 * a.pos.x + h10 * a.vel.x + h01 * b.pos.x + h11 * b.vel.x;
+    pos.y = h00 * a.pos.y + h10 * a.vel.y + h01 * b.pos.y + h11 * b.vel.y;
+    pos.z = h00 * a.pos.z + h10 * a.vel.z + h01 * b.pos.z + h11 * b.vel.z;
+    QuatSlerp(a.quat, b.quat, t, quat);
+}
+
+LUA_FUNCTION(AddRemotePose) {
+    int id = (int)LUA->CheckNumber(1);
+    const char* name = LUA->CheckString(2);
+    remoteSample sample = remoteSample();
+    sample.time = LUA->CheckNumber(3);
+    LUA->CheckType(4, GarrysMod::Lua::Type::Vector);
+    LUA->CheckType(5, GarrysMod::Lua::Type::ANGLE);
+    sample.pos = LUA->GetVector(4);
+    AngleToQuat(LUA->GetAngle(5), sample.quat);
+    if (LUA->IsType(6, GarrysMod::Lua::Type::Vector))
+        sample.vel = LUA->GetVector(6);
+    if (LUA->IsType(7, GarrysMod::Lua::Type::ANGLE)) {
+        const QAngle& angvel = LUA->GetAngle(7);
+        sample.angvel.x = angvel.x;
+        sample.angvel.y = angvel.y;
+        sample.angvel.z = angvel.z;
+    }
+    remotePlayer* player = FindRemotePlayer(id, true);
+    if (player == NULL)
+        LUA->ThrowError("VRMOD: AddRemotePose too many players");
+    remotePose* pose = NULL;
+    for (int i = 0; i < player->poseCount; i++) {
+        if (strcmp(player->poses[i].name, name) == 0) {
+            pose = &player->poses[i];
+            break;
+        }
+    }
+    if (pose == NULL) {
+        if (player->poseCount == MAX_REMOTE_POSES)
+            LUA->ThrowError("VRMOD: AddRemotePose too many poses");
+        pose = &player->poses[player->poseCount++];
+        snprintf(pose->name, sizeof(pose->name), "%s", name);
+    }
+    InsertRemoteSample(pose, sample);
+    return 0;
+}
+
+LUA_FUNCTION(RemoveRemotePoses) {
+    remotePlayer* player = FindRemotePlayer((int)LUA->CheckNumber(1), false);
+    if (player != NULL) {
+        player->used = false;
+        if (g_remotePoseLuaRef == 0)
+            return 0;
+        LUA->ReferencePush(g_remotePoseLuaRef);
+        LUA->PushNumber(player->id);
+        LUA->PushNil();
+        LUA->SetTable(-3);
+        LUA->Pop(1);
+    }
+    return 0;
+}
+
+LUA_FUNCTION(SampleRemotePoses) {
+    double time = LUA->CheckNumber(1);
+    if (LUA->IsType(2, GarrysMod::Lua::Type::NUMBER))
+        g_remoteMaxExtrapolation = (float)LUA->GetNumber(2);
+    if (g_remotePoseLuaRef == 0) {
+        LUA->CreateTable();
+        g_remotePoseLuaRef = LUA->ReferenceCreate();
+    }
+    LUA->ReferencePush(g_remotePoseLuaRef);
+    for (int i = 0; i < MAX_REMOTE_PLAYERS; i++) {
+        const remotePlayer& player = g_remotePlayers[i];
+        if (!player.used)
+            continue;
+        LUA->PushNumber(player.id);
+        LUA->GetTable(-2);
+        if (!LUA->IsType(-1, GarrysMod::Lua::Type::TABLE)) {
+            LUA->Pop(1);
+            LUA->CreateTable();
+            LUA->PushNumber(player.id);
+            LUA->Push(-2);
+            LUA->SetTable(-4);
+        }
+        for (int j = 0; j < player.poseCount; j++) {
+            const remotePose& pose = player.poses[j];
+            if (pose.sampleCount == 0)
+                continue;
+            Vector pos;
+            QAngle ang;
+            float quat[4];
+            SampleRemotePose(&pose, time, pos, quat);
+            QuatToAngle(quat, ang);
+            LUA->GetField(-1, pose.name);
+            if (!LUA->IsType(-1, GarrysMod::Lua::Type::TABLE)) {
+                LUA->Pop(1);
+                LUA->CreateTable();
+                LUA->Push(-1);
+                LUA->SetField(-3, pose.name);
+            }
+            LUA->PushVector(pos);
+            LUA->SetField(-2, "pos");
+            LUA->PushAngle(ang);
+            LUA->SetField(-2, "ang");
+            LUA->Pop(1);
+        }
+        LUA->Pop(1);
+    }
+    return 1;
+}
+
+// Minimal vector math for the IK solver. Source's Vector has no operators in this SDK.
+static inline Vector V3(float x, float y, float z) { Vector v; v.x = x; v.y = y; v.z = z; return v; }
+static inline Vector V3Add(const Vector& a, const Vector& b) { return V3(a.x + b.x, a.y + b.y, a.z + b.z); }
+static inline Vector V3Sub(const Vector& a, const Vector& b) { return V3(a.x - b.x, a.y - b.y, a.z - b.z); }
+static inline Vector V3Scale(const Vector& a, float s) { return V3(a.x * s, a.y * s, a.z * s); }
+static inline float V3Dot(const Vector& a, const Vector& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+static inline Vector V3Cross(const Vector& a, const Vector& b) { return V3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x); }
+static inline float V3Length(const Vector& a) { return sqrtf(V3Dot(a, a)); }
+static inline Vector V3Normalize(const Vector& a) { float len = V3Length(a); return len > 1e-6f ? V3Scale(a, 1.0f / len) : V3(1.0f, 0.0f, 0.0f); }
+
+// Rotates v by the rotation part of a Source matrix.
+static inline Vector RotateVector(const float m[3][4], const Vector& v) {
+    return V3(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+              m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+              m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+}
+
+// Builds a bone matrix at origin with its x axis towards target and z axis as close to
+// hint as possible.
+void BoneMatrix(const Vector& origin, const Vector& target, const Vector& hint, float m[3][4]) {
+    Vector x = V3Normalize(V3Sub(target, origin));
+    Vector z = V3Sub(hint, V3Scale(x, V3Dot(hint, x)));
+    z = V3Length(z) > 1e-4f ? V3Normalize(z) : V3Normalize(V3Cross(x, V3(0.0f, 1.0f, 0.0f)));
+    Vector y = V3Cross(z, x);
+    m[0][0] = x.x; m[0][1] = y.x; m[0][2] = z.x; m[0][3] = origin.x;
+    m[1][0] = x.y; m[1][1] = y.y; m[1][2] = z.y; m[1][3] = origin.y;
+    m[2][0] = x.z; m[2][1] = y.z; m[2][2] = z.z; m[2][3] = origin.z;
+}
+
+void PoseMatrix(const Vector& pos, const float q[4], float m[3][4]) {
+    QuatToMatrix(q, m);
+    m[0][3] = pos.x;
+    m[1][3] = pos.y;
+    m[2][3] = pos.z;
+}
+
+// Analytic two-bone solve: places the middle joint of root->mid->end so the chain reaches
+// towards target, bending in the plane of the pole direction. Returns the end position.
+Vector SolveTwoBone(const Vector& root, const Vector& target, float len1, float len2, const Vector& pole, Vector* mid) {
+    Vector toTarget = V3Sub(target, root);
+    float dist = V3Length(toTarget);
+    Vector dir = V3Normalize(toTarget);
+    float minDist = fabsf(len1 - len2) + 1e-4f;
+    float maxDist = (len1 + len2) * 0.9999f;
+    dist = dist < minDist ? minDist : (dist > maxDist ? maxDist : dist);
+    float cosA = (len1 * len1 + dist * dist - len2 * len2) / (2.0f * len1 * dist);
+    cosA = cosA < -1.0f ? -1.0f : (cosA > 1.0f ? 1.0f : cosA);
+    float sinA = sqrtf(1.0f - cosA * cosA);
+    Vector bend = V3Sub(pole, V3Scale(dir, V3Dot(pole, dir)));
+    bend = V3Length(bend) > 1e-4f ? V3Normalize(bend) : V3Normalize(V3Cross(dir, V3(0.0f, 0.0f, 1.0f)));
+    *mid = V3Add(root, V3Add(V3Scale(dir, len1 * cosA), V3Scale(bend, len1 * sinA)));
+    return V3Add(root, V3Scale(dir, dist));
+}
+
+// FABRIK with a fixed root: joints[0] stays put and joints[count] is pulled to target.
+void SolveFabrik(Vector* joints, const float* lengths, int count, const Vector& target, int iterations) {
+    Vector root = joints[0];
+    for (int it = 0; it < iterations; it++) {
+        joints[count] = target;
+        for (int i = count - 1; i >= 0; i--)
+            joints[i] = V3Add(joints[i + 1], V3Scale(V3Normalize(V3Sub(joints[i], joints[i + 1])), lengths[i]));
+        joints[0] = root;
+        for (int i = 1; i <= count; i++)
+            joints[i] = V3Add(joints[i - 1], V3Scale(V3Normalize(V3Sub(joints[i], joints[i - 1])), lengths[i - 1]));
+    }
+}
+
+void SolveRig(const ikRig* rig, const ikTargets* targets, float bones[IKBone_Max][3][4]) {
+    const Vector up = V3(0.0f, 0.0f, 1.0f);
+    float headMat[3][4];
+    PoseMatrix(targets->pos[IKTarget_Head], targets->quat[IKTarget_Head], headMat);
+    Vector head = targets->pos[IKTarget_Head];
+    Vector neck = V3Add(head, RotateVector(headMat, rig->headToNeck));
+    Vector headForward = RotateVector(headMat, V3(1.0f, 0.0f, 0.0f));
+    Vector forward = V3Normalize(V3(headForward.x, headForward.y, 0.0f));
+    Vector left = V3Cross(up, forward);
+    float spineLength = 0.0f;
+    for (int i = 0; i < rig->spineCount; i++)
+        spineLength += rig->spine[i];
+    float legLength = rig->thigh + rig->shin;
+
+    // Pelvis from the tracker if there is one, otherwise hanging below the neck, slightly
+    // compressed so the spine bends forward, and no higher than the legs can reach.
+    float pelvisMat[3][4];
+    Vector pelvis;
+    if (targets->valid[IKTarget_Pelvis]) {
+        pelvis = targets->pos[IKTarget_Pelvis];
+        PoseMatrix(pelvis, targets->quat[IKTarget_Pelvis], pelvisMat);
+    }
+    else {
+        pelvis = V3Sub(neck, V3Add(V3Scale(up, spineLength * 0.97f), V3Scale(forward, spineLength * 0.05f)));
+        if (targets->valid[IKTarget_LeftFoot] && targets->valid[IKTarget_RightFoot]) {
+            float maxZ = (targets->pos[IKTarget_LeftFoot].z + targets->pos[IKTarget_RightFoot].z) * 0.5f + legLength * 0.98f;
+            pelvis.z = pelvis.z > maxZ ? maxZ : pelvis.z;
+        }
+        BoneMatrix(pelvis, V3Add(pelvis, forward), up, pelvisMat);
+    }
+    memcpy(bones[IKBone_Pelvis], pelvisMat, sizeof(pelvisMat));
+
+    Vector spine[MAX_IK_SPINE + 1];
+    float along = 0.0f;
+    spine[0] = pelvis;
+    for (int i = 1; i <= rig->spineCount; i++) {
+        along += rig->spine[i - 1];
+        float t = along / spineLength;
+        spine[i] = V3Add(V3Add(pelvis, V3Scale(V3Sub(neck, pelvis), t)), V3Scale(forward, 0.1f * rig->spine[i - 1] * (1.0f - t)));
+    }
+    SolveFabrik(spine, rig->spine, rig->spineCount, neck, 8);
+    for (int i = 0; i < rig->spineCount; i++)
+        BoneMatrix(spine[i], spine[i + 1], forward, bones[IKBone_Spine1 + i]);
+    for (int i = rig->spineCount; i < MAX_IK_SPINE; i++)
+        memcpy(bones[IKBone_Spine1 + i], bones[IKBone_Spine1 + rig->spineCount - 1], sizeof(bones[0]));
+    PoseMatrix(head, targets->quat[IKTarget_Head], bones[IKBone_Head]);
+
+    // Chest frame at the top of the spine for the shoulders.
+    float chestMat[3][4];
+    Vector chest = spine[rig->spineCount];
+    BoneMatrix(chest, V3Add(chest, forward), V3Sub(chest, spine[rig->spineCount - 1]), chestMat);
+    for (int side = 0; side < 2; side++) {
+        float mirror = side == 0 ? 1.0f : -1.0f;
+        int target = side == 0 ? IKTarget_LeftHand : IKTarget_RightHand;
+        int upper = side == 0 ? IKBone_LeftUpperArm : IKBone_RightUpperArm;
+        Vector shoulder = V3Add(chest, RotateVector(chestMat, V3(rig->shoulderOffset.x, rig->shoulderOffset.y * mirror, rig->shoulderOffset.z)));
+        Vector pole = RotateVector(chestMat, V3(-0.5f, 0.5f * mirror, -1.0f));
+        Vector handTarget = targets->valid[target] ? targets->pos[target] : V3Sub(shoulder, V3Scale(up, (rig->upperArm + rig->foreArm) * 0.95f));
+        Vector elbow;
+        Vector hand = SolveTwoBone(shoulder, handTarget, rig->upperArm, rig->foreArm, pole, &elbow);
+        BoneMatrix(shoulder, elbow, pole, bones[upper]);
+        BoneMatrix(elbow, hand, pole, bones[upper + 1]);
+        if (targets->valid[target])
+            PoseMatrix(hand, targets->quat[target], bones[upper + 2]);
+        else
+            BoneMatrix(hand, V3Add(hand, V3Sub(hand, elbow)), pole, bones[upper + 2]);
+    }
+    for (int side = 0; side < 2; side++) {
+        float mirror = side == 0 ? 1.0f : -1.0f;
+        int target = side == 0 ? IKTarget_LeftFoot : IKTarget_RightFoot;
+        int thighBone = side == 0 ? IKBone_LeftThigh : IKBone_RightThigh;
+        Vector hip = V3Add(pelvis, RotateVector(pelvisMat, V3(rig->hipOffset.x, rig->hipOffset.y * mirror, rig->hipOffset.z)));
+        Vector pole = V3Add(RotateVector(pelvisMat, V3(1.0f, 0.0f, 0.0f)), V3Scale(left, 0.1f * mirror));
+        Vector footTarget = targets->valid[target] ? targets->pos[target] : V3Sub(hip, V3Scale(up, legLength));
+        Vector knee;
+        Vector foot = SolveTwoBone(hip, footTarget, rig->thigh, rig->shin, pole, &knee);
+        BoneMatrix(hip, knee, pole, bones[thighBone]);
+        BoneMatrix(knee, foot, pole, bones[thighBone + 1]);
+        if (targets->valid[target])
+            PoseMatrix(foot, targets->quat[target], bones[thighBone + 2]);
+        else
+            BoneMatrix(foot, V3Add(foot, forward), up, bones[thighBone + 2]);
+    }
+}
+
+ikRig* FindIKRig(int id, bool create) {
+    ikRig* freeRig = NULL;
+    for (int i = 0; i < MAX_IK_RIGS; i++) {
+        if (g_ikRigs[i].used && g_ikRigs[i].id == id)
+            return &g_ikRigs[i];
+        if (!g_ikRigs[i].used && freeRig == NULL)
+            freeRig = &g_ikRigs[i];
+    }
+    if (!create || freeRig == NULL)
+        return NULL;
+    *freeRig = ikRig();
+    freeRig->used = true;
+    freeRig->id = id;
+    return freeRig;
+}
+
+LUA_FUNCTION(IKRegisterRig) {
+    int id = (int)LUA->CheckNumber(1);
+    LUA->CheckType(2, GarrysMod::Lua::Type::TABLE);
+    // Read into a copy so that a rejected rig leaves the registered one untouched.
+    ikRig parsed = ikRig();
+    ikRig* rig = &parsed;
+    LUA->Push(2);
+    rig->upperArm = GetNumberField(LUA, "upperArm", 0.3f);
+    rig->foreArm = GetNumberField(LUA, "foreArm", 0.27f);
+    rig->thigh = GetNumberField(LUA, "thigh", 0.45f);
+    rig->shin = GetNumberField(LUA, "shin", 0.43f);
+    rig->headToNeck = GetVectorField(LUA, "headToNeck", V3(-0.08f, 0.0f, -0.12f));
+    rig->shoulderOffset = GetVectorField(LUA, "shoulderOffset", V3(0.0f, 0.18f, -0.05f));
+    rig->hipOffset = GetVectorField(LUA, "hipOffset", V3(0.0f, 0.1f, -0.05f));
+    rig->spineCount = 0;
+    LUA->GetField(-1, "spine");
+    if (LUA->IsType(-1, GarrysMod::Lua::Type::TABLE)) {
+        for (int i = 0; i < MAX_IK_SPINE; i++) {
+            LUA->PushNumber(i + 1);
+            LUA->GetTable(-2);
+            if (!LUA->IsType(-1, GarrysMod::Lua::Type::NUMBER)) {
+                LUA->Pop(1);
+                break;
+            }
+            rig->spine[rig->spineCount++] = (float)LUA->GetNumber(-1);
+            LUA->Pop(1);
+        }
+    }
+    LUA->Pop(1);
+    if (rig->spineCount == 0) {
+        rig->spineCount = 3;
+        rig->spine[0] = rig->spine[1] = rig->spine[2] = 0.17f;
+    }
+    static const char* defaultTargets[IKTarget_Max] = { "hmd", "pose_lefthand", "pose_righthand", "pose_leftfoot", "pose_rightfoot", "pose_pelvis" };
+    static const char* targetFields[IKTarget_Max] = { "headTarget", "leftHandTarget", "rightHandTarget", "leftFootTarget", "rightFootTarget", "pelvisTarget" };
+    for (int i = 0; i < IKTarget_Max; i++) {
+        LUA->GetField(-1, targetFields[i]);
+        snprintf(rig->targetNames[i], sizeof(rig->targetNames[i]), "%s", LUA->IsType(-1, GarrysMod::Lua::Type::STRING) ? LUA->GetString(-1) : defaultTargets[i]);
+        LUA->Pop(1);
+    }
+    LUA->Pop(1);
+    // SolveRig divides by the spine and limb lengths.
+    bool valid = rig->upperArm > 0.0f && rig->foreArm > 0.0f && rig->thigh > 0.0f && rig->shin > 0.0f;
+    for (int i = 0; i < rig->spineCount; i++)
+        valid = valid && rig->spine[i] > 0.0f;
+    if (!valid)
+        LUA->ThrowError("VRMOD: IKRegisterRig lengths must be positive");
+    rig = FindIKRig(id, true);
+    if (rig == NULL)
+        LUA->ThrowError("VRMOD: IKRegisterRig too many rigs");
+    int luaRef = rig->luaRef;
+    if (luaRef == 0) {
+        LUA->CreateTable();
+        luaRef = LUA->ReferenceCreate();
+    }
+    *rig = parsed;
+    rig->used = true;
+    rig->id = id;
+    rig->luaRef = luaRef;
+    return 0;
+}
+
+LUA_FUNCTION(IKRemoveRig) {
+    ikRig* rig = FindIKRig((int)LUA->CheckNumber(1), false);
+    if (rig != NULL) {
+        if (rig->luaRef != 0)
+            LUA->ReferenceFree(rig->luaRef);
+        rig->used = false;
+        rig->luaRef = 0;
+    }
+    return 0;
+}
+
+// Solves every registered rig that has an entry in the targets table, in one call.
+// Targets use the GetPoses / SampleRemotePoses layout: targets[id][poseName] = { pos, ang }.
+LUA_FUNCTION(IKSolve) {
+    LUA->CheckType(1, GarrysMod::Lua::Type::TABLE);
+    static const char* boneNames[IKBone_Max] = {
+        "pelvis", "spine1", "spine2", "spine3", "spine4", "head",
+        "upperarm_l", "forearm_l", "hand_l", "upperarm_r", "forearm_r", "hand_r",
+        "thigh_l", "calf_l", "foot_l", "thigh_r", "calf_r", "foot_r",
+    };
+    float bones[IKBone_Max][3][4];
+    LUA->CreateTable();
+    for (int r = 0; r < MAX_IK_RIGS; r++) {
+        const ikRig* rig = &g_ikRigs[r];
+        if (!rig->used)
+            continue;
+        LUA->PushNumber(rig->id);
+        LUA->GetTable(1);
+        if (!LUA->IsType(-1, GarrysMod::Lua::Type::TABLE)) {
+            LUA->Pop(1);
+            continue;
+        }
+        ikTargets targets;
+        for (int i = 0; i < IKTarget_Max; i++) {
+            targets.valid[i] = false;
+            LUA->GetField(-1, rig->targetNames[i]);
+            if (LUA->IsType(-1, GarrysMod::Lua::Type::TABLE)) {
+                LUA->GetField(-1, "pos");
+                LUA->GetField(-2, "ang");
+                if (LUA->IsType(-2, GarrysMod::Lua::Type::Vector) && LUA->IsType(-1, GarrysMod::Lua::Type::ANGLE)) {
+                    targets.pos[i] = LUA->GetVector(-2);
+                    AngleToQuat(LUA->GetAngle(-1), targets.quat[i]);
+                    targets.valid[i] = true;
+                }
+                LUA->Pop(2);
+            }
+            LUA->Pop(1);
+        }
+        LUA->Pop(1);
+        if (!targets.valid[IKTarget_Head])
+            continue;
+        SolveRig(rig, &targets, bones);
+        LUA->PushNumber(rig->id);
+        LUA->ReferencePush(rig->luaRef);
+        for (int i = 0; i < IKBone_Max; i++) {
+            if (i >= IKBone_Spine1 + rig->spineCount && i < IKBone_Spine1 + MAX_IK_SPINE)
+                continue;
+            PushReusableMatrix(LUA, boneNames[i]);
+            WriteVMatrix(LUA, -1, bones[i]);
+            LUA->Pop(1);
+        }
+        LUA->SetTable(-3);
+    }
+    return 1;
+}
+
+// Converts OpenVR bone transforms to Source axes (see PoseToSourceMatrix) and writes them
+// into reusable VMatrix objects at indices 1..count of the table on top of the stack.
+void WriteBoneMatrices(GarrysMod::Lua::ILuaBase* LUA, const vr::VRBoneTransform_t* bones, int count) {
+    float m[3][4];
+    for (int i = 0; i < count; i++) {
+        const vr::HmdQuaternionf_t& q = bones[i].orientation;
+        float quat[4] = { -q.z, -q.x, q.y, q.w };
+        QuatToMatrix(quat, m);
+        m[0][3] = -bones[i].position.v[2];
+        m[1][3] = -bones[i].position.v[0];
+        m[2][3] = bones[i].position.v[1];
+        LUA->PushNumber(i + 1);
+        LUA->GetTable(-2);
+        if (!LUA->IsType(-1, GarrysMod::Lua::Type::MATRIX)) {
+            LUA->Pop(1);
+            PushNewMatrix(LUA);
+            LUA->PushNumber(i + 1);
+            LUA->Push(-2);
+            LUA->SetTable(-4);
+        }
+        WriteVMatrix(LUA, -1, m);
+        LUA->Pop(1);
+    }
+}
+
+vr::EVRSkeletalTransformSpace CheckTransformSpace(GarrysMod::Lua::ILuaBase* LUA, int iStackPos) {
+    if (LUA->IsType(iStackPos, GarrysMod::Lua::Type::STRING) && strcmp(LUA->GetString(iStackPos), "parent") == 0)
+        return vr::VRSkeletalTransformSpace_Parent;
+    return vr::VRSkeletalTransformSpace_Model;
+}
+
+LUA_FUNCTION(GetSkeleton) {
+    int actionIndex = FindAction(LUA->CheckString(1));
+    if (actionIndex == -1 || g_actions[actionIndex].type != ActionType_Skeleton)
+        LUA->ThrowError("VRMOD: GetSkeleton unknown skeleton action");
+    if (g_reconnecting)
+        return 0;
+    vr::EVRSkeletalMotionRange range = LUA->GetBool(3) ? vr::VRSkeletalMotionRange_WithoutController : vr::VRSkeletalMotionRange_WithController;
+    vr::VRBoneTransform_t bones[MAX_BONES];
+    if (g_pInput->GetSkeletalBoneData(g_actions[actionIndex].handle, CheckTransformSpace(LUA, 2), range, bones, MAX_BONES) != vr::VRInputError_None)
+        return 0;
+    LUA->ReferencePush(g_actions[actionIndex].luaRefs[3]);
+    WriteBoneMatrices(LUA, bones, MAX_BONES);
+    return 1;
+}
+
+LUA_FUNCTION(GetSkeletonCompressed) {
+    int actionIndex = FindAction(LUA->CheckString(1));
+    if (actionIndex == -1 || g_actions[actionIndex].type != ActionType_Skeleton)
+        LUA->ThrowError("VRMOD: GetSkeletonCompressed unknown skeleton action");
+    if (g_reconnecting || g_pSystem == NULL)
+        return 0;
+    vr::EVRSkeletalMotionRange range = LUA->GetBool(2) ? vr::VRSkeletalMotionRange_WithoutController : vr::VRSkeletalMotionRange_WithController;
+    char buffer[sizeof(vr::VRBoneTransform_t) * MAX_BONES + 2];
+    uint32_t size = 0;
+    if (g_pInput->GetSkeletalBoneDataCompressed(g_actions[actionIndex].handle, range, buffer, sizeof(buffer), &size) != vr::VRInputError_None)
+        return 0;
+    LUA->PushString(buffer, size);
+    return 1;
 }
 
-LUA_FUNCTION(GetPoses) {
-    vr::InputPoseActionData_t poseActionData;
-    vr::TrackedDevicePose_t pose = g_poses[0];
-    char* poseName = (char*)"hmd";
-    int poseRef = g_luaRefs[LuaRefIndex_HmdPose];
-    LUA->ReferencePush(g_luaRefs[LuaRefIndex_PoseTable]);
-    for (int i = -1; i < g_actionCount; i++) {
-        if (i != -1){
-            if (g_actions[i].type == ActionType_Pose) {
-                g_pInput-> GetPoseActionDataRelativeToNow(g_actions[i].handle, vr::TrackingUniverseStanding, 0, &poseActionData, sizeof(poseActionData), vr::k_ulInvalidInputValueHandle);
-                pose = poseActionData.pose;
-                poseName = g_actions[i].name;
-                poseRef = g_actions[i].luaRefs[0];
-            } else continue;
-        }
-        if (pose.bPoseIsValid) {
-            vr::HmdMatrix34_t mat = pose.mDeviceToAbsoluteTracking;
-            Vector pos;
-            Vector vel;
-            QAngle ang;
-            QAngle angvel;
-            pos.x = -mat.m[2][3];
-            pos.y = -mat.m[0][3];
-            pos.z = mat.m[1][3];
-            ang.x = asinf(mat.m[1][2]) * (180.0f / PI_F);
-            ang.y = atan2f(mat.m[0][2], mat.m[2][2]) * (180.0f / PI_F);
-            ang.z = atan2f(-mat.m[1][0], mat.m[1][1]) * (180.0f / PI_F);
-            vel.x = -pose.vVelocity.v[2];
-            vel.y = -pose.vVelocity.v[0];
-            vel.z = pose.vVelocity.v[1];
-            angvel.x = -pose.vAngularVelocity.v[2] * (180.0f / PI_F);
-            angvel.y = -pose.vAngularVelocity.v[0] * (180.0f / PI_F);
-            angvel.z = pose.vAngularVelocity.v[1] * (180.0f / PI_F);
-            LUA->ReferencePush(poseRef);
-            LUA->PushVector(pos);
-            LUA->SetField(-2, "pos");
-            LUA->PushVector(vel);
-            LUA->SetField(-2, "vel");
-            LUA->PushAngle(ang);
-            LUA->SetField(-2, "ang");
-            LUA->PushAngle(angvel);
-            LUA->SetField(-2, "angvel");
-            LUA->SetField(-2, poseName);
-        }
-    }
+LUA_FUNCTION(DecompressSkeleton) {
+    unsigned int size = 0;
+    const char* data = LUA->GetString(1, &size);
+    if (data == NULL)
+        LUA->ThrowError("VRMOD: DecompressSkeleton expects a string");
+    // Decoding is done by the runtime, so a client without a running SteamVR gets nothing.
+    vr::IVRInput* input = g_reconnecting ? NULL : vr::VRInput();
+    if (input == NULL)
+        return 0;
+    vr::VRBoneTransform_t bones[MAX_BONES];
+    if (input->DecompressSkeletalBoneData(data, size, CheckTransformSpace(LUA, 2), bones, MAX_BONES) != vr::VRInputError_None)
+        return 0;
+    LUA->CreateTable();
+    WriteBoneMatrices(LUA, bones, MAX_BONES);
     return 1;
 }
 
+LUA_FUNCTION(SetSkeletalSummaryType) {
+    int actionIndex = FindAction(LUA->CheckString(1));
+    if (actionIndex == -1 || g_actions[actionIndex].type != ActionType_Skeleton)
+        LUA->ThrowError("VRMOD: SetSkeletalSummaryType unknown skeleton action");
+    g_actions[actionIndex].summaryType = LUA->GetBool(2) ? vr::VRSummaryType_FromAnimation : vr::VRSummaryType_FromDevice;
+    return 0;
+}
+
 LUA_FUNCTION(GetActions) {
     vr::InputDigitalActionData_t digitalActionData;
     vr::InputAnalogActionData_t analogActionData;
@@ -401,11 +3512,19 @@ LUA_FUNCTION(GetActions) {
     char* changedActionNames[MAX_ACTIONS];
     bool changedActionStates[MAX_ACTIONS];
     int changedActionCount = 0;
+    int exportCount = 0;
     LUA->ReferencePush(g_luaRefs[LuaRefIndex_ActionTable]);
+    if (g_reconnecting) {
+        LUA->ReferencePush(g_luaRefs[LuaRefIndex_EmptyTable]);
+        return 2;
+    }
     for (int i = 0; i < g_actionCount; i++) {
         if (g_actions[i].type == ActionType_Boolean) {
-            LUA->PushBool((g_pInput->GetDigitalActionData(g_actions[i].handle, &digitalActionData, sizeof(digitalActionData), vr::k_ulInvalidInputValueHandle) == vr::VRInputError_None && digitalActionData.bState));
+            bool state = g_pInput->GetDigitalActionData(g_actions[i].handle, &digitalActionData, sizeof(digitalActionData), vr::k_ulInvalidInputValueHandle) == vr::VRInputError_None && digitalActionData.bState;
+            LUA->PushBool(state);
             LUA->SetField(-2, g_actions[i].name);
+            if (g_poseExport.map != NULL)
+                StageExportAction(&exportCount, g_actions[i].name, VRMOD_ACTION_BOOLEAN, state, 0.0f, 0.0f);
             if(digitalActionData.bChanged){
                 changedActionNames[changedActionCount] = g_actions[i].name;
                 changedActionStates[changedActionCount] = digitalActionData.bState;
@@ -414,20 +3533,28 @@ LUA_FUNCTION(GetActions) {
         }
         else if (g_actions[i].type == ActionType_Vector1) {
             g_pInput->GetAnalogActionData(g_actions[i].handle, &analogActionData, sizeof(analogActionData), vr::k_ulInvalidInputValueHandle);
+            if (g_actions[i].filter.enabled)
+                FilterAnalog(&g_actions[i].filter, &analogActionData.x, 1);
             LUA->PushNumber(analogActionData.x);
             LUA->SetField(-2, g_actions[i].name);
+            if (g_poseExport.map != NULL)
+                StageExportAction(&exportCount, g_actions[i].name, VRMOD_ACTION_VECTOR1, false, analogActionData.x, 0.0f);
         }
         else if (g_actions[i].type == ActionType_Vector2) {
             LUA->ReferencePush(g_actions[i].luaRefs[0]);
             g_pInput->GetAnalogActionData(g_actions[i].handle, &analogActionData, sizeof(analogActionData), vr::k_ulInvalidInputValueHandle);
+            if (g_actions[i].filter.enabled)
+                FilterAnalog(&g_actions[i].filter, &analogActionData.x, 2);
             LUA->PushNumber(analogActionData.x);
             LUA->SetField(-2, "x");
             LUA->PushNumber(analogActionData.y);
             LUA->SetField(-2, "y");
             LUA->SetField(-2, g_actions[i].name);
+            if (g_poseExport.map != NULL)
+                StageExportAction(&exportCount, g_actions[i].name, VRMOD_ACTION_VECTOR2, false, analogActionData.x, analogActionData.y);
         }
         else if (g_actions[i].type == ActionType_Skeleton) {
-            g_pInput->GetSkeletalSummaryData(g_actions[i].handle, static_cast<vr::EVRSummaryType>(1) , &skeletalSummaryData);
+            g_pInput->GetSkeletalSummaryData(g_actions[i].handle, static_cast<vr::EVRSummaryType>(g_actions[i].summaryType), &skeletalSummaryData);
             LUA->ReferencePush(g_actions[i].luaRefs[0]);
             LUA->ReferencePush(g_actions[i].luaRefs[1]);
             for (int j = 0; j < 5; j++) {
@@ -436,9 +3563,20 @@ LUA_FUNCTION(GetActions) {
                 LUA->SetTable(-3);
             }
             LUA->SetField(-2, "fingerCurls");
+            LUA->ReferencePush(g_actions[i].luaRefs[2]);
+            for (int j = 0; j < 4; j++) {
+                LUA->PushNumber(j + 1);
+                LUA->PushNumber(skeletalSummaryData.flFingerSplay[j]);
+                LUA->SetTable(-3);
+            }
+            LUA->SetField(-2, "fingerSplays");
             LUA->SetField(-2, g_actions[i].name);
         }
     }
+    if (g_poseExport.map != NULL) {
+        g_poseExport.staging.actionCount = exportCount;
+        PublishPoseExport();
+    }
     if (changedActionCount == 0){
         LUA->ReferencePush(g_luaRefs[LuaRefIndex_EmptyTable]);
     }else{
@@ -451,7 +3589,9 @@ LUA_FUNCTION(GetActions) {
     return 2;
 }
 
-LUA_FUNCTION(ShareTextureBegin) {
+// Patches the game's texture creation so the next texture it creates is captured into
+// g_captureTexture. Returns NULL on success or an error description.
+const char* InstallCreateTextureHook() {
     char patch[] = "\x68\x0\x0\x0\x0\xC3\x44\x24\x04\x0\x0\x0\x0\xC3";
     *(uint32_t*)(patch + 1) = (uint32_t)((uintptr_t)CreateTextureHook);
 
@@ -462,9 +3602,9 @@ LUA_FUNCTION(ShareTextureBegin) {
 
 #ifdef _WIN32
     if (!ReadProcessMemory(GetCurrentProcess(), g_createTexture, g_createTextureOrigBytes, 14, NULL))
-        LUA->ThrowError("VRMOD: ReadProcessMemory failed");
+        return "VRMOD: ReadProcessMemory failed";
     if (!WriteProcessMemory(GetCurrentProcess(), g_createTexture, patch, 14, NULL))
-        LUA->ThrowError("VRMOD: WriteProcessMemory failed");
+        return "VRMOD: WriteProcessMemory failed";
 #else
     uintptr_t alignedAddr = (uintptr_t)g_createTexture & ~(getpagesize() - 1);
     size_t patchSize = 14;
@@ -474,7 +3614,7 @@ LUA_FUNCTION(ShareTextureBegin) {
     size_t length = endPage - startPage;
 
     if (mprotect((void*)startPage, length, PROT_READ | PROT_WRITE | PROT_EXEC) == -1)
-        LUA->ThrowError("VRMOD: mprotect failed");
+        return "VRMOD: mprotect failed";
 
     glFinish(); // ensure GL operations complete
     memcpy((void*)g_createTextureOrigBytes, (void*)g_createTexture, 14);
@@ -482,6 +3622,14 @@ LUA_FUNCTION(ShareTextureBegin) {
     glFinish();
 #endif
 
+    return NULL;
+}
+
+LUA_FUNCTION(ShareTextureBegin) {
+    g_captureTexture = &g_sharedTexture;
+    const char* error = InstallCreateTextureHook();
+    if (error != NULL)
+        LUA->ThrowError(error);
     return 0;
 }
 
@@ -490,8 +3638,8 @@ LUA_FUNCTION(ShareTextureFinish) {
     if (!g_sharedTexture)
         LUA->ThrowError("VRMOD: g_sharedTexture is null");
 
-    if (FAILED(D3D11CreateDevice(NULL, D3D_DRIVER_TYPE_HARDWARE, NULL, 0, NULL, 0,
-                                 D3D11_SDK_VERSION, &g_d3d11Device, NULL, NULL)))
+    if (!g_d3d11Device && FAILED(D3D11CreateDevice(NULL, D3D_DRIVER_TYPE_HARDWARE, NULL, 0, NULL, 0,
+                                                   D3D11_SDK_VERSION, &g_d3d11Device, NULL, NULL)))
         LUA->ThrowError("VRMOD: D3D11CreateDevice failed");
 
     ID3D11Resource* res;
@@ -516,6 +3664,728 @@ LUA_FUNCTION(ShareTextureFinish) {
     return 0;
 }
 
+LUA_FUNCTION(ShareDepthBegin) {
+#ifdef _WIN32
+    g_sharedDepthTexture = NULL;
+#else
+    g_sharedDepthTexture = GL_INVALID_VALUE;
+#endif
+    g_captureTexture = &g_sharedDepthTexture;
+    const char* error = InstallCreateTextureHook();
+    if (error != NULL)
+        LUA->ThrowError(error);
+    return 0;
+}
+
+LUA_FUNCTION(ShareDepthFinish) {
+    g_captureTexture = &g_sharedTexture;
+#ifdef _WIN32
+    if (!g_sharedDepthTexture)
+        LUA->ThrowError("VRMOD: g_sharedDepthTexture is null");
+    if (!g_d3d11Device && FAILED(D3D11CreateDevice(NULL, D3D_DRIVER_TYPE_HARDWARE, NULL, 0, NULL, 0,
+                                                   D3D11_SDK_VERSION, &g_d3d11Device, NULL, NULL)))
+        LUA->ThrowError("VRMOD: D3D11CreateDevice failed");
+    ID3D11Resource* res;
+    if (FAILED(g_d3d11Device->OpenSharedResource(g_sharedDepthTexture, __uuidof(ID3D11Resource), (void**)&res)))
+        LUA->ThrowError("VRMOD: OpenSharedResource failed");
+    if (FAILED(res->QueryInterface(__uuidof(ID3D11Texture2D), (void**)&g_d3d11DepthTexture)))
+        LUA->ThrowError("VRMOD: QueryInterface failed");
+    res->Release();
+    g_depthHandle = g_d3d11DepthTexture;
+#else
+    if (g_sharedDepthTexture == GL_INVALID_VALUE || !glIsTexture(g_sharedDepthTexture))
+        LUA->ThrowError("VRMOD: g_sharedDepthTexture is invalid");
+    // The compositor reads it as depth, so a color render target here would be garbage.
+    GLint depthBits = 0;
+    GLint previous = 0;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+    glBindTexture(GL_TEXTURE_2D, g_sharedDepthTexture);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_DEPTH_SIZE, &depthBits);
+    glBindTexture(GL_TEXTURE_2D, previous);
+    if (depthBits == 0)
+        LUA->ThrowError("VRMOD: captured depth texture has no depth format");
+    g_depthHandle = (void*)(uintptr_t)g_sharedDepthTexture;
+#endif
+    g_submitDepth = true;
+    return 0;
+}
+
+LUA_FUNCTION(SetSubmitDepth) {
+    g_submitDepth = LUA->GetBool(1);
+    return 0;
+}
+
+#ifndef _WIN32
+bool HasGLExtension(const char* name) {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; i++) {
+        const char* ext = (const char*)pglGetStringi(GL_EXTENSIONS, i);
+        if (ext != NULL && strcmp(ext, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Splits a space separated extension list in place and appends the names that are not
+// already present. Returns the new count.
+uint32_t AddExtensions(char* list, const char** names, uint32_t count, uint32_t max) {
+    for (char* ext = strtok(list, " "); ext != NULL && count < max; ext = strtok(NULL, " ")) {
+        uint32_t i = 0;
+        while (i < count && strcmp(names[i], ext) != 0)
+            i++;
+        if (i == count)
+            names[count++] = ext;
+    }
+    return count;
+}
+
+void DestroyVulkanSubmit() {
+    if (g_vulkan.device != VK_NULL_HANDLE)
+        pvkDeviceWaitIdle(g_vulkan.device);
+    if (g_vulkan.glMemory != 0)
+        pglDeleteMemoryObjectsEXT(1, &g_vulkan.glMemory);
+    if (g_vulkan.glRenderDone != 0)
+        pglDeleteSemaphoresEXT(1, &g_vulkan.glRenderDone);
+    if (g_vulkan.glReadDone != 0)
+        pglDeleteSemaphoresEXT(1, &g_vulkan.glReadDone);
+    if (g_vulkan.renderDone != VK_NULL_HANDLE)
+        pvkDestroySemaphore(g_vulkan.device, g_vulkan.renderDone, NULL);
+    if (g_vulkan.readDone != VK_NULL_HANDLE)
+        pvkDestroySemaphore(g_vulkan.device, g_vulkan.readDone, NULL);
+    if (g_vulkan.image != VK_NULL_HANDLE)
+        pvkDestroyImage(g_vulkan.device, g_vulkan.image, NULL);
+    if (g_vulkan.memory != VK_NULL_HANDLE)
+        pvkFreeMemory(g_vulkan.device, g_vulkan.memory, NULL);
+    if (g_vulkan.device != VK_NULL_HANDLE)
+        pvkDestroyDevice(g_vulkan.device, NULL);
+    if (g_vulkan.instance != VK_NULL_HANDLE)
+        pvkDestroyInstance(g_vulkan.instance, NULL);
+    if (g_vulkan.lib != NULL)
+        dlclose(g_vulkan.lib);
+    memset(&g_vulkan, 0, sizeof(g_vulkan));
+}
+
+VkSemaphore CreateExportedSemaphore(GLuint* glSemaphore) {
+    VkExportSemaphoreCreateInfo exportInfo = {};
+    exportInfo.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO;
+    exportInfo.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT;
+    VkSemaphoreCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    createInfo.pNext = &exportInfo;
+    VkSemaphore semaphore = VK_NULL_HANDLE;
+    if (pvkCreateSemaphore(g_vulkan.device, &createInfo, NULL, &semaphore) != VK_SUCCESS)
+        return VK_NULL_HANDLE;
+    VkSemaphoreGetFdInfoKHR fdInfo = {};
+    fdInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+    fdInfo.semaphore = semaphore;
+    fdInfo.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT;
+    int fd = -1;
+    if (pvkGetSemaphoreFdKHR(g_vulkan.device, &fdInfo, &fd) == VK_SUCCESS) {
+        // GL takes ownership of the fd on import.
+        pglGenSemaphoresEXT(1, glSemaphore);
+        pglImportSemaphoreFdEXT(*glSemaphore, GL_HANDLE_TYPE_OPAQUE_FD_EXT, fd);
+    }
+    return semaphore;
+}
+
+#define VULKAN_PROC(name) if ((p##name = (PFN_##name)pvkGetInstanceProcAddr(g_vulkan.instance, #name)) == NULL) return "VRMOD: missing " #name
+#define GL_PROC(name, type) p##name = (type)glXGetProcAddress((const GLubyte*)#name)
+
+// Backs g_sharedTexture with a VkImage on the same GPU. Returns NULL on success or an
+// error description, in which case the texture is left untouched.
+const char* InitVulkanSubmit() {
+    GL_PROC(glGetStringi, PFNGLGETSTRINGIPROC);
+    if (pglGetStringi == NULL || !HasGLExtension("GL_EXT_memory_object_fd"))
+        return "VRMOD: GL_EXT_memory_object_fd is not supported";
+    // The semaphores also move the image out of its initial layout, which a plain
+    // glFinish handoff never would.
+    if (!HasGLExtension("GL_EXT_semaphore_fd"))
+        return "VRMOD: GL_EXT_semaphore_fd is not supported";
+    GL_PROC(glGetUnsignedBytevEXT, PFNGLGETUNSIGNEDBYTEVEXTPROC);
+    GL_PROC(glGetUnsignedBytei_vEXT, PFNGLGETUNSIGNEDBYTEI_VEXTPROC);
+    GL_PROC(glCreateMemoryObjectsEXT, PFNGLCREATEMEMORYOBJECTSEXTPROC);
+    GL_PROC(glDeleteMemoryObjectsEXT, PFNGLDELETEMEMORYOBJECTSEXTPROC);
+    GL_PROC(glMemoryObjectParameterivEXT, PFNGLMEMORYOBJECTPARAMETERIVEXTPROC);
+    GL_PROC(glImportMemoryFdEXT, PFNGLIMPORTMEMORYFDEXTPROC);
+    GL_PROC(glTexStorageMem2DEXT, PFNGLTEXSTORAGEMEM2DEXTPROC);
+    GL_PROC(glGenSemaphoresEXT, PFNGLGENSEMAPHORESEXTPROC);
+    GL_PROC(glDeleteSemaphoresEXT, PFNGLDELETESEMAPHORESEXTPROC);
+    GL_PROC(glImportSemaphoreFdEXT, PFNGLIMPORTSEMAPHOREFDEXTPROC);
+    GL_PROC(glSignalSemaphoreEXT, PFNGLSIGNALSEMAPHOREEXTPROC);
+    GL_PROC(glWaitSemaphoreEXT, PFNGLWAITSEMAPHOREEXTPROC);
+
+    GLint width = 0, height = 0, internalFormat = 0, previous = 0;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+    glBindTexture(GL_TEXTURE_2D, g_sharedTexture);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &internalFormat);
+    glBindTexture(GL_TEXTURE_2D, previous);
+    VkFormat format;
+    if (internalFormat == GL_RGBA8)
+        format = VK_FORMAT_R8G8B8A8_UNORM;
+    else if (internalFormat == GL_SRGB8_ALPHA8)
+        format = VK_FORMAT_R8G8B8A8_SRGB;
+    else
+        return "VRMOD: unsupported shared texture format";
+
+    unsigned char deviceUUID[GL_UUID_SIZE_EXT], driverUUID[GL_UUID_SIZE_EXT];
+    pglGetUnsignedBytei_vEXT(GL_DEVICE_UUID_EXT, 0, deviceUUID);
+    pglGetUnsignedBytevEXT(GL_DRIVER_UUID_EXT, driverUUID);
+
+    g_vulkan.lib = dlopen("libvulkan.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (g_vulkan.lib == NULL)
+        return "VRMOD: libvulkan.so.1 not found";
+    pvkGetInstanceProcAddr = (PFN_vkGetInstanceProcAddr)dlsym(g_vulkan.lib, "vkGetInstanceProcAddr");
+    if (pvkGetInstanceProcAddr == NULL)
+        return "VRMOD: missing vkGetInstanceProcAddr";
+    VULKAN_PROC(vkCreateInstance);
+
+    char instanceExtensions[1024] = "";
+    const char* extensions[64];
+    uint32_t extensionCount = 0;
+    vr::VRCompositor()->GetVulkanInstanceExtensionsRequired(instanceExtensions, sizeof(instanceExtensions));
+    extensionCount = AddExtensions(instanceExtensions, extensions, extensionCount, 64);
+    VkApplicationInfo appInfo = {};
+    appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    appInfo.pApplicationName = "vrmod";
+    appInfo.apiVersion = VK_API_VERSION_1_1;
+    VkInstanceCreateInfo instanceInfo = {};
+    instanceInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    instanceInfo.pApplicationInfo = &appInfo;
+    instanceInfo.enabledExtensionCount = extensionCount;
+    instanceInfo.ppEnabledExtensionNames = extensions;
+    if (pvkCreateInstance(&instanceInfo, NULL, &g_vulkan.instance) != VK_SUCCESS)
+        return "VRMOD: vkCreateInstance failed";
+    VULKAN_PROC(vkDestroyInstance);
+    VULKAN_PROC(vkEnumeratePhysicalDevices);
+    VULKAN_PROC(vkGetPhysicalDeviceProperties2);
+    VULKAN_PROC(vkGetPhysicalDeviceQueueFamilyProperties);
+    VULKAN_PROC(vkGetPhysicalDeviceMemoryProperties);
+    VULKAN_PROC(vkCreateDevice);
+    VULKAN_PROC(vkDestroyDevice);
+    VULKAN_PROC(vkGetDeviceQueue);
+    VULKAN_PROC(vkCreateImage);
+    VULKAN_PROC(vkDestroyImage);
+    VULKAN_PROC(vkGetImageMemoryRequirements);
+    VULKAN_PROC(vkAllocateMemory);
+    VULKAN_PROC(vkFreeMemory);
+    VULKAN_PROC(vkBindImageMemory);
+    VULKAN_PROC(vkGetMemoryFdKHR);
+    VULKAN_PROC(vkCreateSemaphore);
+    VULKAN_PROC(vkDestroySemaphore);
+    VULKAN_PROC(vkGetSemaphoreFdKHR);
+    VULKAN_PROC(vkQueueSubmit);
+    VULKAN_PROC(vkDeviceWaitIdle);
+
+    // Memory can only be shared with the Vulkan device that GL itself runs on.
+    VkPhysicalDevice devices[16];
+    uint32_t deviceCount = 16;
+    pvkEnumeratePhysicalDevices(g_vulkan.instance, &deviceCount, devices);
+    for (uint32_t i = 0; i < deviceCount && g_vulkan.physicalDevice == VK_NULL_HANDLE; i++) {
+        VkPhysicalDeviceIDProperties idProps = {};
+        idProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+        VkPhysicalDeviceProperties2 props = {};
+        props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        props.pNext = &idProps;
+        pvkGetPhysicalDeviceProperties2(devices[i], &props);
+        if (memcmp(idProps.deviceUUID, deviceUUID, VK_UUID_SIZE) == 0 && memcmp(idProps.driverUUID, driverUUID, VK_UUID_SIZE) == 0)
+            g_vulkan.physicalDevice = devices[i];
+    }
+    if (g_vulkan.physicalDevice == VK_NULL_HANDLE)
+        return "VRMOD: no Vulkan device matches the GL device";
+    uint64_t outputDevice = 0;
+    g_pSystem->GetOutputDevice(&outputDevice, vr::TextureType_Vulkan, g_vulkan.instance);
+    if (outputDevice != 0 && outputDevice != (uint64_t)(uintptr_t)g_vulkan.physicalDevice)
+        return "VRMOD: the HMD is not connected to the GL device";
+
+    VkQueueFamilyProperties families[16];
+    uint32_t familyCount = 16;
+    pvkGetPhysicalDeviceQueueFamilyProperties(g_vulkan.physicalDevice, &familyCount, families);
+    uint32_t family = 0;
+    while (family < familyCount && !(families[family].queueFlags & VK_QUEUE_GRAPHICS_BIT))
+        family++;
+    if (family == familyCount)
+        return "VRMOD: no Vulkan graphics queue";
+
+    char deviceExtensions[1024] = "VK_KHR_external_memory_fd VK_KHR_external_semaphore_fd ";
+    size_t len = strlen(deviceExtensions);
+    vr::VRCompositor()->GetVulkanDeviceExtensionsRequired(g_vulkan.physicalDevice, deviceExtensions + len, (uint32_t)(sizeof(deviceExtensions) - len));
+    extensionCount = AddExtensions(deviceExtensions, extensions, 0, 64);
+    float priority = 1.0f;
+    VkDeviceQueueCreateInfo queueInfo = {};
+    queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queueInfo.queueFamilyIndex = family;
+    queueInfo.queueCount = 1;
+    queueInfo.pQueuePriorities = &priority;
+    VkDeviceCreateInfo deviceInfo = {};
+    deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    deviceInfo.queueCreateInfoCount = 1;
+    deviceInfo.pQueueCreateInfos = &queueInfo;
+    deviceInfo.enabledExtensionCount = extensionCount;
+    deviceInfo.ppEnabledExtensionNames = extensions;
+    if (pvkCreateDevice(g_vulkan.physicalDevice, &deviceInfo, NULL, &g_vulkan.device) != VK_SUCCESS)
+        return "VRMOD: vkCreateDevice failed";
+    pvkGetDeviceQueue(g_vulkan.device, family, 0, &g_vulkan.queue);
+
+    VkExternalMemoryImageCreateInfo externalInfo = {};
+    externalInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
+    externalInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+    VkImageCreateInfo imageInfo = {};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.pNext = &externalInfo;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = format;
+    imageInfo.extent.width = width;
+    imageInfo.extent.height = height;
+    imageInfo.extent.depth = 1;
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    if (pvkCreateImage(g_vulkan.device, &imageInfo, NULL, &g_vulkan.image) != VK_SUCCESS)
+        return "VRMOD: vkCreateImage failed";
+
+    VkMemoryRequirements requirements;
+    pvkGetImageMemoryRequirements(g_vulkan.device, g_vulkan.image, &requirements);
+    VkPhysicalDeviceMemoryProperties memoryProps;
+    pvkGetPhysicalDeviceMemoryProperties(g_vulkan.physicalDevice, &memoryProps);
+    uint32_t memoryType = 0;
+    while (memoryType < memoryProps.memoryTypeCount && (!(requirements.memoryTypeBits & (1u << memoryType)) ||
+           !(memoryProps.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)))
+        memoryType++;
+    if (memoryType == memoryProps.memoryTypeCount)
+        return "VRMOD: no device local memory for the shared texture";
+    VkMemoryDedicatedAllocateInfo dedicatedInfo = {};
+    dedicatedInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+    dedicatedInfo.image = g_vulkan.image;
+    VkExportMemoryAllocateInfo exportInfo = {};
+    exportInfo.sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO;
+    exportInfo.pNext = &dedicatedInfo;
+    exportInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+    VkMemoryAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.pNext = &exportInfo;
+    allocInfo.allocationSize = requirements.size;
+    allocInfo.memoryTypeIndex = memoryType;
+    if (pvkAllocateMemory(g_vulkan.device, &allocInfo, NULL, &g_vulkan.memory) != VK_SUCCESS)
+        return "VRMOD: vkAllocateMemory failed";
+    if (pvkBindImageMemory(g_vulkan.device, g_vulkan.image, g_vulkan.memory, 0) != VK_SUCCESS)
+        return "VRMOD: vkBindImageMemory failed";
+
+    g_vulkan.renderDone = CreateExportedSemaphore(&g_vulkan.glRenderDone);
+    g_vulkan.readDone = CreateExportedSemaphore(&g_vulkan.glReadDone);
+    if (g_vulkan.glRenderDone == 0 || g_vulkan.glReadDone == 0)
+        return "VRMOD: semaphore export failed";
+
+    VkMemoryGetFdInfoKHR fdInfo = {};
+    fdInfo.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
+    fdInfo.memory = g_vulkan.memory;
+    fdInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT;
+    int fd = -1;
+    if (pvkGetMemoryFdKHR(g_vulkan.device, &fdInfo, &fd) != VK_SUCCESS)
+        return "VRMOD: vkGetMemoryFdKHR failed";
+    while (glGetError() != GL_NO_ERROR);
+    GLint dedicated = GL_TRUE;
+    pglCreateMemoryObjectsEXT(1, &g_vulkan.glMemory);
+    pglMemoryObjectParameterivEXT(g_vulkan.glMemory, GL_DEDICATED_MEMORY_OBJECT_EXT, &dedicated);
+    pglImportMemoryFdEXT(g_vulkan.glMemory, requirements.size, GL_HANDLE_TYPE_OPAQUE_FD_EXT, fd);
+    if (glGetError() != GL_NO_ERROR) {
+        close(fd);
+        return "VRMOD: glImportMemoryFdEXT failed";
+    }
+    // The game keeps drawing into the same texture name, now backed by the VkImage.
+    glBindTexture(GL_TEXTURE_2D, g_sharedTexture);
+    pglTexStorageMem2DEXT(GL_TEXTURE_2D, 1, internalFormat, width, height, g_vulkan.glMemory, 0);
+    GLint immutable = GL_FALSE;
+    glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_IMMUTABLE_FORMAT, &immutable);
+    if (glGetError() != GL_NO_ERROR || !immutable) {
+        // Some drivers drop the old storage even when the import is rejected.
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glBindTexture(GL_TEXTURE_2D, previous);
+        return "VRMOD: glTexStorageMem2DEXT failed";
+    }
+    glBindTexture(GL_TEXTURE_2D, previous);
+
+    g_vulkan.data.m_nImage = (uint64_t)g_vulkan.image;
+    g_vulkan.data.m_pDevice = g_vulkan.device;
+    g_vulkan.data.m_pPhysicalDevice = g_vulkan.physicalDevice;
+    g_vulkan.data.m_pInstance = g_vulkan.instance;
+    g_vulkan.data.m_pQueue = g_vulkan.queue;
+    g_vulkan.data.m_nQueueFamilyIndex = family;
+    g_vulkan.data.m_nWidth = width;
+    g_vulkan.data.m_nHeight = height;
+    g_vulkan.data.m_nFormat = format;
+    g_vulkan.data.m_nSampleCount = 1;
+    g_vulkan.texture.handle = &g_vulkan.data;
+    g_vulkan.texture.eType = vr::TextureType_Vulkan;
+    return NULL;
+}
+
+#undef VULKAN_PROC
+
+// Hands the frame from GL to the compositor's queue in TRANSFER_SRC_OPTIMAL layout.
+void VulkanSubmitBegin() {
+    GLenum layout = GL_LAYOUT_TRANSFER_SRC_EXT;
+    pglSignalSemaphoreEXT(g_vulkan.glRenderDone, 0, NULL, 1, &g_sharedTexture, &layout);
+    glFlush();
+    VkPipelineStageFlags stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    VkSubmitInfo submit = {};
+    submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit.waitSemaphoreCount = 1;
+    submit.pWaitSemaphores = &g_vulkan.renderDone;
+    submit.pWaitDstStageMask = &stage;
+    pvkQueueSubmit(g_vulkan.queue, 1, &submit, VK_NULL_HANDLE);
+}
+
+// Keeps GL from drawing the next frame before the compositor's copy has finished.
+void VulkanSubmitEnd() {
+    VkSubmitInfo submit = {};
+    submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit.signalSemaphoreCount = 1;
+    submit.pSignalSemaphores = &g_vulkan.readDone;
+    pvkQueueSubmit(g_vulkan.queue, 1, &submit, VK_NULL_HANDLE);
+    GLenum layout = GL_LAYOUT_TRANSFER_SRC_EXT;
+    pglWaitSemaphoreEXT(g_vulkan.glReadDone, 0, NULL, 1, &g_sharedTexture, &layout);
+}
+#endif
+
+LUA_FUNCTION(SetVulkanSubmission) {
+    bool enable = LUA->GetBool(1);
+#ifdef _WIN32
+    if (enable) {
+        LUA->PushBool(false);
+        LUA->PushString("VRMOD: Vulkan submission is only available on Linux");
+        return 2;
+    }
+#else
+    if (enable && g_vulkan.device == VK_NULL_HANDLE) {
+        if (g_pSystem == NULL)
+            LUA->ThrowError("VRMOD: Init must be called first");
+        if (g_sharedTexture == GL_INVALID_VALUE || !glIsTexture(g_sharedTexture))
+            LUA->ThrowError("VRMOD: ShareTextureFinish must be called first");
+        const char* error = InitVulkanSubmit();
+        if (error != NULL) {
+            DestroyVulkanSubmit();
+            LUA->PushBool(false);
+            LUA->PushString(error);
+            return 2;
+        }
+    }
+    g_vulkan.enabled = enable;
+#endif
+    LUA->PushBool(true);
+    return 1;
+}
+
+#ifndef _WIN32
+void CloseSpectatorRing() {
+    if (g_spectator.map == NULL)
+        return;
+    munmap(g_spectator.map, g_spectator.mapSize);
+    unlink(g_spectator.path);
+    g_spectator.map = NULL;
+}
+
+void StopSpectatorStream() {
+    if (g_spectator.fbo[0] != 0) {
+        for (int i = 0; i < SPECTATOR_PBOS; i++) {
+            if (g_spectator.fence[i] != NULL)
+                pglDeleteSync(g_spectator.fence[i]);
+        }
+        pglDeleteBuffers(SPECTATOR_PBOS, g_spectator.pbo);
+        pglDeleteFramebuffers(2, g_spectator.fbo);
+        glDeleteTextures(1, &g_spectator.texture);
+    }
+    CloseSpectatorRing();
+    memset(&g_spectator, 0, sizeof(g_spectator));
+}
+
+const char* StartSpectatorStream(const char* name, int eyes, int downscale, int frameSkip, int slots) {
+    GL_PROC(glGenFramebuffers, PFNGLGENFRAMEBUFFERSPROC);
+    GL_PROC(glDeleteFramebuffers, PFNGLDELETEFRAMEBUFFERSPROC);
+    GL_PROC(glFramebufferTexture2D, PFNGLFRAMEBUFFERTEXTURE2DPROC);
+    GL_PROC(glBlitFramebuffer, PFNGLBLITFRAMEBUFFERPROC);
+    GL_PROC(glGenBuffers, PFNGLGENBUFFERSPROC);
+    GL_PROC(glDeleteBuffers, PFNGLDELETEBUFFERSPROC);
+    GL_PROC(glBindBuffer, PFNGLBINDBUFFERPROC);
+    GL_PROC(glBufferData, PFNGLBUFFERDATAPROC);
+    GL_PROC(glMapBufferRange, PFNGLMAPBUFFERRANGEPROC);
+    GL_PROC(glUnmapBuffer, PFNGLUNMAPBUFFERPROC);
+    GL_PROC(glFenceSync, PFNGLFENCESYNCPROC);
+    GL_PROC(glClientWaitSync, PFNGLCLIENTWAITSYNCPROC);
+    GL_PROC(glDeleteSync, PFNGLDELETESYNCPROC);
+    if (pglBindFramebuffer == NULL || pglBlitFramebuffer == NULL || pglMapBufferRange == NULL || pglFenceSync == NULL)
+        return "VRMOD: GL 3.2 is required for the spectator stream";
+
+    GLint textureWidth = 0, textureHeight = 0, previousTexture = 0;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &previousTexture);
+    glBindTexture(GL_TEXTURE_2D, g_sharedTexture);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &textureWidth);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &textureHeight);
+    glBindTexture(GL_TEXTURE_2D, previousTexture);
+    const vr::VRTextureBounds_t* bounds = (eyes & 1) ? &g_textureBoundsLeft : &g_textureBoundsRight;
+    int eyeWidth = (int)(fabsf(bounds->uMax - bounds->uMin) * textureWidth) / downscale;
+    int eyeHeight = (int)(fabsf(bounds->vMax - bounds->vMin) * textureHeight) / downscale;
+    if (eyeWidth <= 0 || eyeHeight <= 0)
+        return "VRMOD: SetSubmitTextureBounds must be called first";
+    g_spectator.eyes = eyes;
+    g_spectator.downscale = downscale;
+    g_spectator.frameSkip = frameSkip;
+    g_spectator.textureWidth = textureWidth;
+    g_spectator.textureHeight = textureHeight;
+    g_spectator.width = eyeWidth * (eyes == 3 ? 2 : 1);
+    g_spectator.height = eyeHeight;
+
+    // Replace rather than truncate a previous ring so readers still mapping it are unaffected.
+    uint32_t stride = g_spectator.width * 4;
+    uint64_t slotOffset = (sizeof(vrmodSpectatorHeader) + 63) & ~63;
+    uint64_t slotSize = (sizeof(vrmodSpectatorSlot) + (uint64_t)stride * g_spectator.height + 63) & ~63;
+    snprintf(g_spectator.path, sizeof(g_spectator.path), "/dev/shm/%s", name);
+    unlink(g_spectator.path);
+    int fd = open(g_spectator.path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1)
+        return "VRMOD: failed to create the spectator ring in /dev/shm";
+    g_spectator.mapSize = (size_t)(slotOffset + slotSize * slots);
+    if (ftruncate(fd, g_spectator.mapSize) == 0)
+        g_spectator.map = (uint8_t*)mmap(NULL, g_spectator.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (g_spectator.map == NULL || g_spectator.map == MAP_FAILED) {
+        g_spectator.map = NULL;
+        unlink(g_spectator.path);
+        return "VRMOD: failed to map the spectator ring";
+    }
+    vrmodSpectatorHeader* header = (vrmodSpectatorHeader*)g_spectator.map;
+    header->version = VRMOD_SPECTATOR_VERSION;
+    header->slotCount = slots;
+    header->width = g_spectator.width;
+    header->height = g_spectator.height;
+    header->stride = stride;
+    header->slotOffset = slotOffset;
+    header->slotSize = slotSize;
+    __atomic_store_n(&header->magic, VRMOD_SPECTATOR_MAGIC, __ATOMIC_RELEASE);
+
+    GLint previousRead = 0, previousDraw = 0, previousPack = 0;
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &previousRead);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousDraw);
+    glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &previousPack);
+    glGenTextures(1, &g_spectator.texture);
+    glBindTexture(GL_TEXTURE_2D, g_spectator.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, g_spectator.width, g_spectator.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, previousTexture);
+    pglGenFramebuffers(2, g_spectator.fbo);
+    pglBindFramebuffer(GL_READ_FRAMEBUFFER, g_spectator.fbo[0]);
+    pglFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, g_sharedTexture, 0);
+    pglBindFramebuffer(GL_DRAW_FRAMEBUFFER, g_spectator.fbo[1]);
+    pglFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, g_spectator.texture, 0);
+    pglBindFramebuffer(GL_READ_FRAMEBUFFER, previousRead);
+    pglBindFramebuffer(GL_DRAW_FRAMEBUFFER, previousDraw);
+    pglGenBuffers(SPECTATOR_PBOS, g_spectator.pbo);
+    for (int i = 0; i < SPECTATOR_PBOS; i++) {
+        pglBindBuffer(GL_PIXEL_PACK_BUFFER, g_spectator.pbo[i]);
+        pglBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)stride * g_spectator.height, NULL, GL_STREAM_READ);
+    }
+    pglBindBuffer(GL_PIXEL_PACK_BUFFER, previousPack);
+    if (glGetError() != GL_NO_ERROR)
+        return "VRMOD: failed to create the spectator readback buffers";
+    return NULL;
+}
+
+#undef GL_PROC
+
+// Copies every finished readback into the ring, oldest first, without waiting on the GPU.
+void PublishSpectatorFrames() {
+    vrmodSpectatorHeader* header = (vrmodSpectatorHeader*)g_spectator.map;
+    size_t size = (size_t)header->stride * header->height;
+    while (g_spectator.fence[g_spectator.pending] != NULL) {
+        int i = g_spectator.pending;
+        GLenum status = pglClientWaitSync(g_spectator.fence[i], 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+        pglDeleteSync(g_spectator.fence[i]);
+        g_spectator.fence[i] = NULL;
+        g_spectator.pending = (i + 1) % SPECTATOR_PBOS;
+        pglBindBuffer(GL_PIXEL_PACK_BUFFER, g_spectator.pbo[i]);
+        const void* pixels = pglMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+        if (pixels == NULL) {
+            g_spectator.dropped++;
+            continue;
+        }
+        uint64_t frame = header->latest + 1;
+        vrmodSpectatorSlot* slot = (vrmodSpectatorSlot*)(g_spectator.map + header->slotOffset + (frame % header->slotCount) * header->slotSize);
+        uint32_t sequence = slot->sequence;
+        __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        slot->frame = frame;
+        slot->time = g_spectator.submitTime[i];
+        memcpy(slot + 1, pixels, size);
+        __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+        __atomic_store_n(&header->latest, frame, __ATOMIC_RELEASE);
+        pglUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        float latency = (float)(InitClock() - g_spectator.submitTime[i]);
+        g_spectator.latency = g_spectator.published == 0 ? latency : g_spectator.latency * 0.9f + latency * 0.1f;
+        g_spectator.published++;
+    }
+}
+
+// Called after both eyes are submitted. A capture is dropped instead of stalling when all
+// PBOs are still in flight.
+void UpdateSpectatorStream() {
+    GLint previousRead = 0, previousDraw = 0, previousPack = 0;
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &previousRead);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousDraw);
+    glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &previousPack);
+    PublishSpectatorFrames();
+    int i = g_spectator.next;
+    bool capture = g_spectator.frameCounter++ % (g_spectator.frameSkip + 1) == 0;
+    if (capture && g_spectator.fence[i] != NULL) {
+        g_spectator.dropped++;
+        capture = false;
+    }
+    if (capture) {
+        GLboolean scissor = glIsEnabled(GL_SCISSOR_TEST);
+        GLboolean srgb = glIsEnabled(GL_FRAMEBUFFER_SRGB);
+        glDisable(GL_SCISSOR_TEST);
+        glDisable(GL_FRAMEBUFFER_SRGB);
+        pglBindFramebuffer(GL_READ_FRAMEBUFFER, g_spectator.fbo[0]);
+        pglBindFramebuffer(GL_DRAW_FRAMEBUFFER, g_spectator.fbo[1]);
+        // The eye's top row is at vMin, so blitting vMin to row 0 leaves the copy top row first.
+        int eyeWidth = g_spectator.eyes == 3 ? g_spectator.width / 2 : g_spectator.width;
+        int x = 0;
+        for (int eye = 0; eye < 2; eye++) {
+            if (!(g_spectator.eyes & (1 << eye)))
+                continue;
+            const vr::VRTextureBounds_t* b = eye == 0 ? &g_textureBoundsLeft : &g_textureBoundsRight;
+            pglBlitFramebuffer((GLint)(b->uMin * g_spectator.textureWidth), (GLint)(b->vMin * g_spectator.textureHeight),
+                               (GLint)(b->uMax * g_spectator.textureWidth), (GLint)(b->vMax * g_spectator.textureHeight),
+                               x, 0, x + eyeWidth, g_spectator.height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+            x += eyeWidth;
+        }
+        pglBindFramebuffer(GL_READ_FRAMEBUFFER, g_spectator.fbo[1]);
+        pglBindBuffer(GL_PIXEL_PACK_BUFFER, g_spectator.pbo[i]);
+        glReadPixels(0, 0, g_spectator.width, g_spectator.height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        g_spectator.fence[i] = pglFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        g_spectator.submitTime[i] = g_frameStats.submitTime;
+        g_spectator.next = (i + 1) % SPECTATOR_PBOS;
+        g_spectator.captured++;
+        if (scissor)
+            glEnable(GL_SCISSOR_TEST);
+        if (srgb)
+            glEnable(GL_FRAMEBUFFER_SRGB);
+    }
+    pglBindFramebuffer(GL_READ_FRAMEBUFFER, previousRead);
+    pglBindFramebuffer(GL_DRAW_FRAMEBUFFER, previousDraw);
+    pglBindBuffer(GL_PIXEL_PACK_BUFFER, previousPack);
+}
+#endif
+
+LUA_FUNCTION(SetSpectatorStream) {
+    bool enable = LUA->GetBool(1);
+#ifdef _WIN32
+    if (enable) {
+        LUA->PushBool(false);
+        LUA->PushString("VRMOD: the spectator stream is only available on Linux");
+        return 2;
+    }
+#else
+    StopSpectatorStream();
+    if (enable) {
+        if (g_sharedTexture == GL_INVALID_VALUE || !glIsTexture(g_sharedTexture))
+            LUA->ThrowError("VRMOD: ShareTextureFinish must be called first");
+        char name[MAX_STR_LEN] = "vrmod_spectator";
+        int eyes = 3, downscale = 2, frameSkip = 0, slots = 3;
+        if (LUA->IsType(2, GarrysMod::Lua::Type::TABLE)) {
+            LUA->Push(2);
+            LUA->GetField(-1, "name");
+            if (LUA->IsType(-1, GarrysMod::Lua::Type::STRING))
+                snprintf(name, sizeof(name), "%s", LUA->GetString(-1));
+            LUA->Pop(1);
+            LUA->GetField(-1, "eyes");
+            if (LUA->IsType(-1, GarrysMod::Lua::Type::STRING)) {
+                const char* value = LUA->GetString(-1);
+                eyes = strcmp(value, "left") == 0 ? 1 : strcmp(value, "right") == 0 ? 2 : strcmp(value, "both") == 0 ? 3 : 0;
+            }
+            LUA->Pop(1);
+            downscale = (int)GetNumberField(LUA, "downscale", (float)downscale);
+            frameSkip = (int)GetNumberField(LUA, "frameSkip", (float)frameSkip);
+            slots = (int)GetNumberField(LUA, "slots", (float)slots);
+            LUA->Pop(1);
+        }
+        if (eyes == 0)
+            LUA->ThrowError("VRMOD: eyes must be \"left\", \"right\" or \"both\"");
+        if (name[0] == '\0' || strchr(name, '/') != NULL)
+            LUA->ThrowError("VRMOD: invalid spectator stream name");
+        downscale = downscale < 1 ? 1 : downscale > 16 ? 16 : downscale;
+        frameSkip = frameSkip < 0 ? 0 : frameSkip;
+        slots = slots < 2 ? 2 : slots > SPECTATOR_MAX_SLOTS ? SPECTATOR_MAX_SLOTS : slots;
+        const char* error = StartSpectatorStream(name, eyes, downscale, frameSkip, slots);
+        if (error != NULL) {
+            StopSpectatorStream();
+            LUA->PushBool(false);
+            LUA->PushString(error);
+            return 2;
+        }
+        g_spectator.enabled = true;
+    }
+#endif
+    LUA->PushBool(true);
+    return 1;
+}
+
+// Latency is the smoothed time from submit to publish, in seconds.
+LUA_FUNCTION(GetSpectatorStats) {
+    LUA->CreateTable();
+#ifndef _WIN32
+    LUA->PushBool(g_spectator.enabled);
+    LUA->SetField(-2, "enabled");
+    LUA->PushNumber((double)g_spectator.captured);
+    LUA->SetField(-2, "captured");
+    LUA->PushNumber((double)g_spectator.published);
+    LUA->SetField(-2, "published");
+    LUA->PushNumber((double)g_spectator.dropped);
+    LUA->SetField(-2, "dropped");
+    LUA->PushNumber(g_spectator.latency);
+    LUA->SetField(-2, "latency");
+    LUA->PushNumber(g_spectator.width);
+    LUA->SetField(-2, "width");
+    LUA->PushNumber(g_spectator.height);
+    LUA->SetField(-2, "height");
+    if (g_spectator.enabled) {
+        LUA->PushString(g_spectator.path);
+        LUA->SetField(-2, "path");
+    }
+#endif
+    return 1;
+}
+
+// Submits one eye, with the render pose and depth when a depth texture is shared so the
+// compositor can reproject positionally.
+vr::EVRCompositorError SubmitEye(vr::EVREye eye, const vr::VRTextureBounds_t* bounds) {
+#ifndef _WIN32
+    // The compositor cannot pair a Vulkan color image with a GL depth texture.
+    if (g_vulkan.enabled) {
+        g_vulkan.texture.eColorSpace = g_vrTexture.eColorSpace;
+        return vr::VRCompositor()->Submit(eye, &g_vulkan.texture, bounds);
+    }
+#endif
+    if (!g_submitDepth || g_depthHandle == NULL || !g_hasEyeProjection)
+        return vr::VRCompositor()->Submit(eye, &g_vrTexture, bounds);
+    vr::VRTextureWithPoseAndDepth_t texture;
+    texture.handle = g_vrTexture.handle;
+    texture.eType = g_vrTexture.eType;
+    texture.eColorSpace = g_vrTexture.eColorSpace;
+    texture.mDeviceToAbsoluteTracking = (g_lastPoses[0].bPoseIsValid ? g_lastPoses[0] : g_poses[0]).mDeviceToAbsoluteTracking;
+    texture.depth.handle = g_depthHandle;
+    texture.depth.mProjection = g_eyeProjection[eye];
+    texture.depth.vRange.v[0] = 0.0f;
+    texture.depth.vRange.v[1] = 1.0f;
+    return vr::VRCompositor()->Submit(eye, &texture, bounds, (vr::EVRSubmitFlags)(vr::Submit_TextureWithPose | vr::Submit_TextureWithDepth));
+}
+
 LUA_FUNCTION(SetSubmitTextureBounds) {
     g_textureBoundsLeft.uMin  = (float)LUA->CheckNumber(1);
     g_textureBoundsLeft.vMin  = (float)LUA->CheckNumber(2);
@@ -531,6 +4401,16 @@ LUA_FUNCTION(SetSubmitTextureBounds) {
 }
 
 LUA_FUNCTION(SubmitSharedTexture) {
+    if (g_reconnecting || g_waitStalled || g_loadingMode)
+        return 0;
+    // While suspended only submit often enough to keep the compositor from treating the
+    // application as hung.
+    if (!ShouldRenderScene()) {
+        double now = InitClock();
+        if (now - g_keepAliveTime < g_keepAliveInterval)
+            return 0;
+        g_keepAliveTime = now;
+    }
 #ifndef _WIN32
     if (g_sharedTexture == 0 || g_sharedTexture == GL_INVALID_VALUE || !glIsTexture(g_sharedTexture)) {
         LUA->ThrowError("VRMOD: Invalid shared texture.");
@@ -566,8 +4446,24 @@ LUA_FUNCTION(SubmitSharedTexture) {
         return 0;
     }
 
-    vr::EVRCompositorError errLeft = vr::VRCompositor()->Submit(vr::Eye_Left, &g_vrTexture, &g_textureBoundsLeft);
-    vr::EVRCompositorError errRight = vr::VRCompositor()->Submit(vr::Eye_Right, &g_vrTexture, &g_textureBoundsRight);
+#ifndef _WIN32
+    if (g_vulkan.enabled)
+        VulkanSubmitBegin();
+#endif
+    vr::EVRCompositorError errLeft = SubmitEye(vr::Eye_Left, &g_textureBoundsLeft);
+    vr::EVRCompositorError errRight = SubmitEye(vr::Eye_Right, &g_textureBoundsRight);
+#ifndef _WIN32
+    if (g_vulkan.enabled)
+        VulkanSubmitEnd();
+#endif
+    if (g_runningStart)
+        vr::VRCompositor()->PostPresentHandoff();
+    g_frameStats.submitTime = InitClock();
+    g_frameStats.poseToSubmit = (float)(g_frameStats.submitTime - g_frameStats.waitEnd);
+#ifndef _WIN32
+    if (g_spectator.enabled)
+        UpdateSpectatorStream();
+#endif
 
     if (errLeft != vr::VRCompositorError_None || errRight != vr::VRCompositorError_None) {
         std::string errMsg = "VRMOD: OpenVR Submit failed: Left: " + std::to_string(errLeft) + ", Right: " + std::to_string(errRight);
@@ -577,12 +4473,256 @@ LUA_FUNCTION(SubmitSharedTexture) {
     return 0;
 }
 
+vrOverlay* CheckOverlay(GarrysMod::Lua::ILuaBase* LUA, int iStackPos) {
+    int id = (int)LUA->CheckNumber(iStackPos);
+    if (id < 1 || id > MAX_OVERLAYS || !g_overlays[id - 1].used)
+        LUA->ThrowError("VRMOD: invalid overlay");
+    return &g_overlays[id - 1];
+}
+
+void CheckOverlayError(GarrysMod::Lua::ILuaBase* LUA, vr::EVROverlayError error) {
+    if (error != vr::VROverlayError_None)
+        LUA->ThrowError(vr::VROverlay()->GetOverlayErrorNameFromEnum(error));
+}
+
+LUA_FUNCTION(OverlayCreate) {
+    const char* key = LUA->CheckString(1);
+    const char* name = LUA->CheckString(2);
+    float width = LUA->IsType(3, GarrysMod::Lua::Type::NUMBER) ? (float)LUA->GetNumber(3) : 1.0f;
+    if (vr::VROverlay() == NULL)
+        LUA->ThrowError("VRMOD: VROverlay failed");
+    int id = -1;
+    for (int i = 0; i < MAX_OVERLAYS; i++) {
+        if (!g_overlays[i].used) {
+            id = i;
+            break;
+        }
+    }
+    if (id == -1)
+        LUA->ThrowError("VRMOD: OverlayCreate too many overlays");
+    vrOverlay* o = &g_overlays[id];
+    memset(o, 0, sizeof(*o));
+    snprintf(o->key, MAX_STR_LEN, "vrmod.%s", key);
+    snprintf(o->name, MAX_STR_LEN, "%s", name);
+    CheckOverlayError(LUA, vr::VROverlay()->CreateOverlay(o->key, o->name, &o->handle));
+    o->used = true;
+    o->width = width;
+    o->device = vr::k_unTrackedDeviceIndexInvalid;
+    o->transform.m[0][0] = o->transform.m[1][1] = o->transform.m[2][2] = 1.0f;
+    o->bounds.uMax = o->bounds.vMax = 1.0f;
+#ifdef _WIN32
+    o->sharedTexture = NULL;
+#else
+    o->sharedTexture = GL_INVALID_VALUE;
+#endif
+    CheckOverlayError(LUA, ApplyOverlayState(o));
+    LUA->PushNumber(id + 1);
+    return 1;
+}
+
+LUA_FUNCTION(OverlayDestroy) {
+    vrOverlay* o = CheckOverlay(LUA, 1);
+    if (g_pSystem != NULL && vr::VROverlay() != NULL)
+        vr::VROverlay()->DestroyOverlay(o->handle);
+#ifdef _WIN32
+    if (o->d3d11Texture)
+        o->d3d11Texture->Release();
+#endif
+    o->used = false;
+    return 0;
+}
+
+// Position and angle are in the same space and units as GetPoses, or relative to the
+// tracked device given by deviceIndex.
+LUA_FUNCTION(OverlaySetTransform) {
+    vrOverlay* o = CheckOverlay(LUA, 1);
+    Vector pos = LUA->GetVector(2);
+    QAngle ang = LUA->GetAngle(3);
+    float q[4], m[3][4];
+    AngleToQuat(ang, q);
+    QuatToMatrix(q, m);
+    m[0][3] = pos.x;
+    m[1][3] = pos.y;
+    m[2][3] = pos.z;
+    SourceToPoseMatrix(m, &o->transform);
+    o->device = LUA->IsType(4, GarrysMod::Lua::Type::NUMBER) ? (vr::TrackedDeviceIndex_t)LUA->GetNumber(4) : vr::k_unTrackedDeviceIndexInvalid;
+    if (LUA->IsType(5, GarrysMod::Lua::Type::NUMBER))
+        o->width = (float)LUA->GetNumber(5);
+    if (g_reconnecting)
+        return 0;
+    if (o->device != vr::k_unTrackedDeviceIndexInvalid)
+        CheckOverlayError(LUA, vr::VROverlay()->SetOverlayTransformTrackedDeviceRelative(o->handle, o->device, &o->transform));
+    else
+        CheckOverlayError(LUA, vr::VROverlay()->SetOverlayTransformAbsolute(o->handle, vr::TrackingUniverseStanding, &o->transform));
+    CheckOverlayError(LUA, vr::VROverlay()->SetOverlayWidthInMeters(o->handle, o->width));
+    return 0;
+}
+
+LUA_FUNCTION(OverlaySetTextureBounds) {
+    vrOverlay* o = CheckOverlay(LUA, 1);
+    o->bounds.uMin = (float)LUA->CheckNumber(2);
+    o->bounds.vMin = (float)LUA->CheckNumber(3);
+    o->bounds.uMax = (float)LUA->CheckNumber(4);
+    o->bounds.vMax = (float)LUA->CheckNumber(5);
+    if (g_reconnecting)
+        return 0;
+    CheckOverlayError(LUA, vr::VROverlay()->SetOverlayTextureBounds(o->handle, &o->bounds));
+    return 0;
+}
+
+LUA_FUNCTION(OverlaySetVisible) {
+    vrOverlay* o = CheckOverlay(LUA, 1);
+    o->visible = LUA->GetBool(2);
+    if (g_reconnecting)
+        return 0;
+    CheckOverlayError(LUA, o->visible ? vr::VROverlay()->ShowOverlay(o->handle) : vr::VROverlay()->HideOverlay(o->handle));
+    return 0;
+}
+
+// Same capture as ShareTextureBegin/Finish: the next texture the game creates (e.g. with
+// GetRenderTarget) between these calls becomes the overlay's texture.
+LUA_FUNCTION(OverlayCaptureBegin) {
+    vrOverlay* o = CheckOverlay(LUA, 1);
+#ifdef _WIN32
+    o->sharedTexture = NULL;
+#else
+    o->sharedTexture = GL_INVALID_VALUE;
+#endif
+    g_captureTexture = &o->sharedTexture;
+    const char* error = InstallCreateTextureHook();
+    if (error != NULL)
+        LUA->ThrowError(error);
+    return 0;
+}
+
+LUA_FUNCTION(OverlayCaptureFinish) {
+    vrOverlay* o = CheckOverlay(LUA, 1);
+    g_captureTexture = &g_sharedTexture;
+#ifdef _WIN32
+    if (!o->sharedTexture)
+        LUA->ThrowError("VRMOD: overlay texture was not captured");
+    if (!g_d3d11Device && FAILED(D3D11CreateDevice(NULL, D3D_DRIVER_TYPE_HARDWARE, NULL, 0, NULL, 0,
+                                                   D3D11_SDK_VERSION, &g_d3d11Device, NULL, NULL)))
+        LUA->ThrowError("VRMOD: D3D11CreateDevice failed");
+    // Drop the texture of an earlier capture.
+    if (o->d3d11Texture) {
+        o->d3d11Texture->Release();
+        o->d3d11Texture = NULL;
+        o->hasTexture = false;
+    }
+    ID3D11Resource* res;
+    if (FAILED(g_d3d11Device->OpenSharedResource(o->sharedTexture, __uuidof(ID3D11Resource), (void**)&res)))
+        LUA->ThrowError("VRMOD: OpenSharedResource failed");
+    HRESULT hr = res->QueryInterface(__uuidof(ID3D11Texture2D), (void**)&o->d3d11Texture);
+    res->Release();
+    if (FAILED(hr)) {
+        o->d3d11Texture = NULL;
+        LUA->ThrowError("VRMOD: QueryInterface failed");
+    }
+    o->texture.handle = o->d3d11Texture;
+    o->texture.eType = vr::TextureType_DirectX;
+#else
+    if (o->sharedTexture == GL_INVALID_VALUE)
+        LUA->ThrowError("VRMOD: overlay texture was not captured");
+    o->texture.handle = (void*)(uintptr_t)o->sharedTexture;
+    o->texture.eType = vr::TextureType_OpenGL;
+#endif
+    o->texture.eColorSpace = vr::ColorSpace_Auto;
+    o->hasTexture = true;
+    if (!g_reconnecting)
+        CheckOverlayError(LUA, vr::VROverlay()->SetOverlayTexture(o->handle, &o->texture));
+    return 0;
+}
+
+// Hands the current contents of the overlay texture to the compositor. Only needed after
+// the texture has been redrawn.
+LUA_FUNCTION(OverlayUpdate) {
+    vrOverlay* o = CheckOverlay(LUA, 1);
+    if (!o->hasTexture || g_reconnecting)
+        return 0;
+    CheckOverlayError(LUA, vr::VROverlay()->SetOverlayTexture(o->handle, &o->texture));
+    return 0;
+}
+
+// Hands the view to the compositor for a level load: either an overlay's captured texture
+// as a lat-long panorama skybox, a color fade, or by default the SteamVR grid. Scene
+// rendering is suspended until EndLoadingMode. While reconnecting the view is only recorded
+// and shown once the runtime is back.
+LUA_FUNCTION(BeginLoadingMode) {
+    if (g_loadingMode || (!g_reconnecting && (g_pSystem == NULL || vr::VRCompositor() == NULL)))
+        return 0;
+    g_loadingFade = LUA->IsType(2, GarrysMod::Lua::Type::NUMBER) ? (float)LUA->GetNumber(2) : 0.5f;
+    g_loadingSkybox = g_loadingColor = false;
+    if (LUA->IsType(1, GarrysMod::Lua::Type::NUMBER)) {
+        vrOverlay* o = CheckOverlay(LUA, 1);
+        if (!o->hasTexture)
+            LUA->ThrowError("VRMOD: BeginLoadingMode overlay has no texture");
+        g_loadingOverlay = (int)(o - g_overlays);
+        g_loadingSkybox = true;
+    }
+    else if (LUA->IsType(1, GarrysMod::Lua::Type::TABLE)) {
+        LUA->Push(1);
+        g_loadingRGB[0] = GetNumberField(LUA, "r", 0.0f) / 255.0f;
+        g_loadingRGB[1] = GetNumberField(LUA, "g", 0.0f) / 255.0f;
+        g_loadingRGB[2] = GetNumberField(LUA, "b", 0.0f) / 255.0f;
+        LUA->Pop(1);
+        g_loadingColor = true;
+    }
+    if (!g_reconnecting) {
+        vr::EVRCompositorError error = ApplyLoadingMode(g_loadingFade);
+        if (error != vr::VRCompositorError_None)
+            LUA->ThrowError(("VRMOD: SetSkyboxOverride failed: " + std::to_string(error)).c_str());
+    }
+    g_loadingMode = true;
+    return 0;
+}
+
+LUA_FUNCTION(EndLoadingMode) {
+    if (!g_loadingMode)
+        return 0;
+    g_loadingMode = false;
+    // A runtime that is still reconnecting never got the loading view.
+    if (g_reconnecting || g_pSystem == NULL || vr::VRCompositor() == NULL)
+        return 0;
+    vr::IVRCompositor* compositor = vr::VRCompositor();
+    compositor->SuspendRendering(false);
+    if (g_loadingSkybox)
+        compositor->ClearSkyboxOverride();
+    else if (g_loadingColor)
+        compositor->FadeToColor(g_loadingFade, 0.0f, 0.0f, 0.0f, 0.0f);
+    else
+        compositor->FadeGrid(g_loadingFade, false);
+    return 0;
+}
+
 LUA_FUNCTION(Shutdown) {
+    JoinInitThread();
+    StopWaitThread();
+    for (int i = 0; i < MAX_OVERLAYS; i++) {
+        if (!g_overlays[i].used)
+            continue;
+        if (g_pSystem != NULL)
+            vr::VROverlay()->DestroyOverlay(g_overlays[i].handle);
+#ifdef _WIN32
+        if (g_overlays[i].d3d11Texture)
+            g_overlays[i].d3d11Texture->Release();
+#endif
+        g_overlays[i].used = false;
+    }
+    if (g_reprojection.halfRate && g_pSystem != NULL)
+        vr::VRCompositor()->ForceInterleavedReprojectionOn(false);
+    g_reprojection.halfRate = false;
+    g_reprojection.switchCount = 0;
+    if (g_loadingMode && g_pSystem != NULL && g_loadingSkybox)
+        vr::VRCompositor()->ClearSkyboxOverride();
+    g_loadingMode = false;
     if (vr::VRCompositor()) {
         vr::VRCompositor()->ClearLastSubmittedFrame();
         vr::VRCompositor()->SuspendRendering(true);
     }
 
+    StopDeviceCache();
+
     if (g_pSystem != NULL) {
         vr::VR_Shutdown();
         g_pSystem = NULL;
@@ -597,8 +4737,15 @@ LUA_FUNCTION(Shutdown) {
     }
     g_luaRefCount = 0;
 
+    for (unsigned int i = 0; i < vr::k_unMaxTrackedDeviceCount; i++) {
+        if (g_devicePoseLuaRefs[i] != 0) {
+            LUA->ReferenceFree(g_devicePoseLuaRefs[i]);
+            g_devicePoseLuaRefs[i] = 0;
+        }
+    }
+
     for (int i = 0; i < g_actionCount; i++) {
-        for (int j = 0; j < 2; j++) {
+        for (int j = 0; j < ACTION_LUAREFS; j++) {
             if (g_actions[i].luaRefs[j] != 0) {
                 LUA->ReferenceFree(g_actions[i].luaRefs[j]);
                 g_actions[i].luaRefs[j] = 0;
@@ -608,6 +4755,12 @@ LUA_FUNCTION(Shutdown) {
     g_actionCount = 0;
     g_actionSetCount = 0;
     g_activeActionSetCount = 0;
+    ResetPoseHistory();
+    memset(g_trackingStates, 0, sizeof(g_trackingStates));
+    ClosePoseExport();
+    g_submitDepth = false;
+    g_depthHandle = NULL;
+    g_hasEyeProjection = false;
 
 #ifdef _WIN32
     if (g_d3d11Device) {
@@ -615,18 +4768,23 @@ LUA_FUNCTION(Shutdown) {
         g_d3d11Device = NULL;
     }
     g_d3d11Texture = NULL;
+    g_d3d11DepthTexture = NULL;
     g_pD3D9Device = NULL;
     g_sharedTexture = NULL;
+    g_sharedDepthTexture = NULL;
 #else
+    g_sharedDepthTexture = GL_INVALID_VALUE;
     if (pglBindFramebuffer)
         pglBindFramebuffer(GL_FRAMEBUFFER, 0);
 
     glBindTexture(GL_TEXTURE_2D, 0);
 
+    StopSpectatorStream();
     if (g_sharedTexture != GL_INVALID_VALUE && g_sharedTexture != 0) {
         glDeleteTextures(1, &g_sharedTexture);
         g_sharedTexture = GL_INVALID_VALUE;
     }
+    DestroyVulkanSubmit();
 
     if (g_vrTexture.handle) {
         GLuint texHandle = (GLuint)(uintptr_t)g_vrTexture.handle;
@@ -650,24 +4808,24 @@ LUA_FUNCTION(Shutdown) {
 
 
 LUA_FUNCTION(TriggerHaptic) {
-    const char* actionName = LUA->CheckString(1);
-    for (int i = 0; i < g_actionCount; i++) {
-        if (strcmp(g_actions[i].name, actionName) == 0) {
-            g_pInput->TriggerHapticVibrationAction(g_actions[i].handle, (float)LUA->CheckNumber(2), (float)LUA->CheckNumber(3), (float)LUA->CheckNumber(4), (float)LUA->CheckNumber(5), vr::k_ulInvalidInputValueHandle);
-            break;
-        }
-    }
+    int actionIndex = FindAction(LUA->CheckString(1));
+    if (actionIndex != -1 && !g_reconnecting)
+        g_pInput->TriggerHapticVibrationAction(g_actions[actionIndex].handle, (float)LUA->CheckNumber(2), (float)LUA->CheckNumber(3), (float)LUA->CheckNumber(4), (float)LUA->CheckNumber(5), vr::k_ulInvalidInputValueHandle);
     return 0;
 }
 
 LUA_FUNCTION(GetTrackedDeviceNames) {
+    trackedDevice devices[vr::k_unMaxTrackedDeviceCount];
+    {
+        std::lock_guard<std::mutex> lock(g_deviceMutex);
+        memcpy(devices, g_devices, sizeof(devices));
+    }
     LUA->CreateTable();
     int tableIndex = 1;
-    char name[MAX_STR_LEN];
-    for (int i = 0; i < vr::k_unMaxTrackedDeviceCount; i++) {
-        if (g_pSystem->GetStringTrackedDeviceProperty(i, vr::Prop_ControllerType_String, name, MAX_STR_LEN) > 1) {
+    for (unsigned int i = 0; i < vr::k_unMaxTrackedDeviceCount; i++) {
+        if (devices[i].connected && devices[i].controllerType[0]) {
             LUA->PushNumber(tableIndex);
-            LUA->PushString(name);
+            LUA->PushString(devices[i].controllerType);
             LUA->SetTable(-3);
             tableIndex++;
         }
@@ -675,7 +4833,46 @@ LUA_FUNCTION(GetTrackedDeviceNames) {
     return 1;
 }
 
+LUA_FUNCTION(GetDevices) {
+    trackedDevice devices[vr::k_unMaxTrackedDeviceCount];
+    {
+        std::lock_guard<std::mutex> lock(g_deviceMutex);
+        memcpy(devices, g_devices, sizeof(devices));
+    }
+    LUA->CreateTable();
+    int tableIndex = 1;
+    for (unsigned int i = 0; i < vr::k_unMaxTrackedDeviceCount; i++) {
+        if (!devices[i].connected)
+            continue;
+        LUA->PushNumber(tableIndex);
+        LUA->CreateTable();
+        LUA->PushNumber(i);
+        LUA->SetField(-2, "index");
+        LUA->PushNumber(devices[i].deviceClass);
+        LUA->SetField(-2, "class");
+        LUA->PushNumber(devices[i].role);
+        LUA->SetField(-2, "role");
+        LUA->PushString(devices[i].controllerType);
+        LUA->SetField(-2, "controllerType");
+        LUA->PushString(devices[i].serial);
+        LUA->SetField(-2, "serial");
+        LUA->PushString(devices[i].model);
+        LUA->SetField(-2, "model");
+        if (devices[i].hasBattery) {
+            LUA->PushNumber(devices[i].battery);
+            LUA->SetField(-2, "battery");
+            LUA->PushBool(devices[i].charging);
+            LUA->SetField(-2, "charging");
+        }
+        LUA->SetTable(-3);
+        tableIndex++;
+    }
+    return 1;
+}
+
 GMOD_MODULE_OPEN(){
+    SelectEulerBatch();
+    InitReprojection();
     LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
     LUA->GetField(-1, "vrmod");
     if (!LUA->IsType(-1, GarrysMod::Lua::Type::TABLE)) {
@@ -688,6 +4885,34 @@ GMOD_MODULE_OPEN(){
     LUA->SetField(-2, "IsHMDPresent");
     LUA->PushCFunction(Init);
     LUA->SetField(-2, "Init");
+    LUA->PushCFunction(InitAsync);
+    LUA->SetField(-2, "InitAsync");
+    LUA->PushCFunction(GetInitState);
+    LUA->SetField(-2, "GetInitState");
+    LUA->PushCFunction(GetReconnectCount);
+    LUA->SetField(-2, "GetReconnectCount");
+    LUA->PushCFunction(Reconnect);
+    LUA->SetField(-2, "Reconnect");
+    LUA->PushCFunction(SetRenderSuspension);
+    LUA->SetField(-2, "SetRenderSuspension");
+    LUA->PushCFunction(ShouldRender);
+    LUA->SetField(-2, "ShouldRender");
+    LUA->PushCFunction(SetReprojectionController);
+    LUA->SetField(-2, "SetReprojectionController");
+    LUA->PushCFunction(IsHalfRate);
+    LUA->SetField(-2, "IsHalfRate");
+    LUA->PushCFunction(GetReprojectionHistory);
+    LUA->SetField(-2, "GetReprojectionHistory");
+    LUA->PushCFunction(SetFrameScheduling);
+    LUA->SetField(-2, "SetFrameScheduling");
+    LUA->PushCFunction(GetFrameTimeRemaining);
+    LUA->SetField(-2, "GetFrameTimeRemaining");
+    LUA->PushCFunction(GetFrameTimingStats);
+    LUA->SetField(-2, "GetFrameTimingStats");
+    LUA->PushCFunction(SetWaitWatchdog);
+    LUA->SetField(-2, "SetWaitWatchdog");
+    LUA->PushCFunction(GetWatchdogStats);
+    LUA->SetField(-2, "GetWatchdogStats");
     LUA->PushCFunction(SetActionManifest);
     LUA->SetField(-2, "SetActionManifest");
     LUA->PushCFunction(SetActiveActionSets);
@@ -698,26 +4923,135 @@ GMOD_MODULE_OPEN(){
     LUA->SetField(-2, "UpdatePosesAndActions");
     LUA->PushCFunction(GetPoses);
     LUA->SetField(-2, "GetPoses");
+    LUA->PushCFunction(GetDevicePoses);
+    LUA->SetField(-2, "GetDevicePoses");
+    LUA->PushCFunction(SetPoseOutputMode);
+    LUA->SetField(-2, "SetPoseOutputMode");
+    LUA->PushCFunction(SetTrackingOrigin);
+    LUA->SetField(-2, "SetTrackingOrigin");
+    LUA->PushCFunction(SetPoseSampling);
+    LUA->SetField(-2, "SetPoseSampling");
+    LUA->PushCFunction(SetPosePrediction);
+    LUA->SetField(-2, "SetPosePrediction");
+    LUA->PushCFunction(SetActionFilter);
+    LUA->SetField(-2, "SetActionFilter");
+    LUA->PushCFunction(SetPoseHistory);
+    LUA->SetField(-2, "SetPoseHistory");
+    LUA->PushCFunction(GetFrameTime);
+    LUA->SetField(-2, "GetFrameTime");
+    LUA->PushCFunction(GetPoseAt);
+    LUA->SetField(-2, "GetPoseAt");
+    LUA->PushCFunction(SetTrackingLossHold);
+    LUA->SetField(-2, "SetTrackingLossHold");
+    LUA->PushCFunction(SetPoseExport);
+    LUA->SetField(-2, "SetPoseExport");
+    LUA->PushCFunction(GetPoseKernel);
+    LUA->SetField(-2, "GetPoseKernel");
     LUA->PushCFunction(GetActions);
     LUA->SetField(-2, "GetActions");
+    LUA->PushCFunction(EncodePoses);
+    LUA->SetField(-2, "EncodePoses");
+    LUA->PushCFunction(DecodePoses);
+    LUA->SetField(-2, "DecodePoses");
+    LUA->PushCFunction(ResetPoseCodec);
+    LUA->SetField(-2, "ResetPoseCodec");
+    LUA->PushCFunction(AddRemotePose);
+    LUA->SetField(-2, "AddRemotePose");
+    LUA->PushCFunction(RemoveRemotePoses);
+    LUA->SetField(-2, "RemoveRemotePoses");
+    LUA->PushCFunction(SampleRemotePoses);
+    LUA->SetField(-2, "SampleRemotePoses");
+    LUA->PushCFunction(IKRegisterRig);
+    LUA->SetField(-2, "IKRegisterRig");
+    LUA->PushCFunction(IKRemoveRig);
+    LUA->SetField(-2, "IKRemoveRig");
+    LUA->PushCFunction(IKSolve);
+    LUA->SetField(-2, "IKSolve");
+    LUA->PushCFunction(GetSkeleton);
+    LUA->SetField(-2, "GetSkeleton");
+    LUA->PushCFunction(GetSkeletonCompressed);
+    LUA->SetField(-2, "GetSkeletonCompressed");
+    LUA->PushCFunction(DecompressSkeleton);
+    LUA->SetField(-2, "DecompressSkeleton");
+    LUA->PushCFunction(SetSkeletalSummaryType);
+    LUA->SetField(-2, "SetSkeletalSummaryType");
     LUA->PushCFunction(ShareTextureBegin);
     LUA->SetField(-2, "ShareTextureBegin");
     LUA->PushCFunction(ShareTextureFinish);
     LUA->SetField(-2, "ShareTextureFinish");
+    LUA->PushCFunction(ShareDepthBegin);
+    LUA->SetField(-2, "ShareDepthBegin");
+    LUA->PushCFunction(ShareDepthFinish);
+    LUA->SetField(-2, "ShareDepthFinish");
+    LUA->PushCFunction(SetSubmitDepth);
+    LUA->SetField(-2, "SetSubmitDepth");
+    LUA->PushCFunction(SetVulkanSubmission);
+    LUA->SetField(-2, "SetVulkanSubmission");
+    LUA->PushCFunction(SetSpectatorStream);
+    LUA->SetField(-2, "SetSpectatorStream");
+    LUA->PushCFunction(GetSpectatorStats);
+    LUA->SetField(-2, "GetSpectatorStats");
     LUA->PushCFunction(SetSubmitTextureBounds);
     LUA->SetField(-2, "SetSubmitTextureBounds");
     LUA->PushCFunction(SubmitSharedTexture);
     LUA->SetField(-2, "SubmitSharedTexture");
+    LUA->PushCFunction(OverlayCreate);
+    LUA->SetField(-2, "OverlayCreate");
+    LUA->PushCFunction(OverlayDestroy);
+    LUA->SetField(-2, "OverlayDestroy");
+    LUA->PushCFunction(OverlaySetTransform);
+    LUA->SetField(-2, "OverlaySetTransform");
+    LUA->PushCFunction(OverlaySetTextureBounds);
+    LUA->SetField(-2, "OverlaySetTextureBounds");
+    LUA->PushCFunction(OverlaySetVisible);
+    LUA->SetField(-2, "OverlaySetVisible");
+    LUA->PushCFunction(OverlayCaptureBegin);
+    LUA->SetField(-2, "OverlayCaptureBegin");
+    LUA->PushCFunction(OverlayCaptureFinish);
+    LUA->SetField(-2, "OverlayCaptureFinish");
+    LUA->PushCFunction(OverlayUpdate);
+    LUA->SetField(-2, "OverlayUpdate");
+    LUA->PushCFunction(BeginLoadingMode);
+    LUA->SetField(-2, "BeginLoadingMode");
+    LUA->PushCFunction(EndLoadingMode);
+    LUA->SetField(-2, "EndLoadingMode");
     LUA->PushCFunction(Shutdown);
     LUA->SetField(-2, "Shutdown");
     LUA->PushCFunction(TriggerHaptic);
     LUA->SetField(-2, "TriggerHaptic");
     LUA->PushCFunction(GetTrackedDeviceNames);
     LUA->SetField(-2, "GetTrackedDeviceNames");
+    LUA->PushCFunction(GetDevices);
+    LUA->SetField(-2, "GetDevices");
     LUA->SetField(-2, "vrmod");
     return 0;
 }
 
 GMOD_MODULE_CLOSE(){
+#ifndef _WIN32
+    CloseSpectatorRing();
+#endif
+    ClosePoseExport();
+    StopWaitThread();
+    StopDeviceCache();
+    JoinInitThread();
+    if (g_pSystem != NULL) {
+        vr::VR_Shutdown();
+        g_pSystem = NULL;
+    }
+    FinishWaitThreads();
+    free(g_poseHistoryBuffer);
+    g_poseHistoryBuffer = NULL;
+    g_poseHistoryCapacity = 0;
+    if (g_remotePoseLuaRef != 0) {
+        LUA->ReferenceFree(g_remotePoseLuaRef);
+        g_remotePoseLuaRef = 0;
+    }
+    for (int i = 0; i < MAX_IK_RIGS; i++) {
+        if (g_ikRigs[i].used && g_ikRigs[i].luaRef != 0)
+            LUA->ReferenceFree(g_ikRigs[i].luaRef);
+        g_ikRigs[i].used = false;
+        g_ikRigs[i].luaRef = 0;
+    }
     return 0;
 }
\ No newline at end of file
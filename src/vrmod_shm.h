@@ -0,0 +1,117 @@
+// Layouts of the shared memory files the vrmod module publishes under /dev/shm, for
+// readers in other processes. Plain C, include it as is.
+//
+// Every block the module rewrites is guarded by a sequence counter: it is odd while the
+// module is writing and advances by two per write. A reader copies the block out and keeps
+// the copy only if the counter was even and unchanged before and after:
+//
+//     uint32_t seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+//     ... copy ...
+//     __atomic_thread_fence(__ATOMIC_ACQUIRE);
+//     valid = !(seq & 1) && seq == __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+//
+// Times are CLOCK_MONOTONIC seconds.
+
+#ifndef VRMOD_SHM_H
+#define VRMOD_SHM_H
+
+#include <stdint.h>
+
+// Spectator stream, /dev/shm/<name> from vrmod.SetSpectatorStream. Frames are RGBA8, top
+// row first, with the enabled eyes side by side (left first).
+#define VRMOD_SPECTATOR_MAGIC   0x50535256u // "VRSP"
+#define VRMOD_SPECTATOR_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;        // bytes per row
+    uint64_t slotOffset;    // offset of the first slot from the start of the file
+    uint64_t slotSize;      // bytes from one slot to the next
+    uint64_t latest;        // newest published frame, 0 before the first one
+} vrmodSpectatorHeader;
+
+// Frame n is in slot n % slotCount, and its pixels follow the slot header.
+typedef struct {
+    uint32_t sequence;
+    uint32_t reserved;
+    uint64_t frame;
+    double time;            // when the frame was submitted
+} vrmodSpectatorSlot;
+
+// Pose export, /dev/shm/<name> from vrmod.SetPoseExport. The whole file is one block
+// rewritten each time GetPoses or GetActions runs; use vrmodReadPoseExport to take a
+// consistent copy. Positions and velocities use Source axes in the units GetPoses returns,
+// angular velocities are degrees per second and quaternions are x, y, z, w.
+#define VRMOD_POSES_MAGIC       0x53505256u // "VRPS"
+#define VRMOD_POSES_VERSION     1
+#define VRMOD_MAX_POSES         65          // hmd and up to 64 pose actions
+#define VRMOD_MAX_ACTIONS       64
+#define VRMOD_NAME_LEN          64
+
+#define VRMOD_ACTION_BOOLEAN    1
+#define VRMOD_ACTION_VECTOR1    2
+#define VRMOD_ACTION_VECTOR2    3
+
+typedef struct {
+    char name[VRMOD_NAME_LEN];
+    uint32_t valid;
+    float pos[3];
+    float quat[4];
+    float vel[3];
+    float angvel[3];
+} vrmodPose;
+
+typedef struct {
+    char name[VRMOD_NAME_LEN];
+    uint32_t type;
+    uint32_t state;         // boolean actions
+    float x;                // vector1 and vector2 actions
+    float y;                // vector2 actions
+} vrmodAction;
+
+// Same fields as vrmod.GetFrameTimingStats, in seconds.
+typedef struct {
+    double waitEnd;         // when WaitGetPoses returned
+    double frameTime;       // compositor time of the frame, as used by GetPoseAt
+    float wait;
+    float sleep;
+    float poseToSubmit;
+    float submitToWait;
+    float frameInterval;
+    float displayFrequency;
+    uint32_t frames;
+    uint32_t droppedFrames;
+    uint32_t misPresented;
+    uint32_t reserved;
+} vrmodFrameTiming;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;          // sizeof(vrmodPoseExport) of the writer
+    uint32_t sequence;
+    uint64_t update;        // incremented on every write
+    double time;            // when this update was written
+    vrmodFrameTiming timing;
+    uint32_t poseCount;
+    uint32_t actionCount;
+    vrmodPose poses[VRMOD_MAX_POSES];
+    vrmodAction actions[VRMOD_MAX_ACTIONS];
+} vrmodPoseExport;
+
+// Copies the latest update into out. Returns 0 if the writer was mid-update, in which case
+// the caller should simply try again.
+static inline int vrmodReadPoseExport(const vrmodPoseExport* shm, vrmodPoseExport* out) {
+    uint32_t sequence = __atomic_load_n(&shm->sequence, __ATOMIC_ACQUIRE);
+    if (sequence & 1)
+        return 0;
+    __builtin_memcpy(out, (const void*)shm, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return sequence == __atomic_load_n(&shm->sequence, __ATOMIC_RELAXED);
+}
+
+#endif
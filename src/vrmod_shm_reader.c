@@ -0,0 +1,59 @@
+// Example reader for the pose export. Prints the latest poses and actions a few times per
+// second until interrupted.
+//
+//     gcc -O2 -o vrmod_shm_reader src/vrmod_shm_reader.c
+//     ./vrmod_shm_reader [name]
+//
+// The game side has to call vrmod.SetPoseExport(true, name) first.
+
+#include "vrmod_shm.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+int main(int argc, char** argv) {
+    char path[256];
+    snprintf(path, sizeof(path), "/dev/shm/%s", argc > 1 ? argv[1] : "vrmod_poses");
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return 1;
+    }
+    const vrmodPoseExport* shm = (const vrmodPoseExport*)mmap(NULL, sizeof(vrmodPoseExport), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (shm->magic != VRMOD_POSES_MAGIC || shm->version != VRMOD_POSES_VERSION || shm->size != sizeof(vrmodPoseExport)) {
+        fprintf(stderr, "%s: unsupported layout (version %u)\n", path, shm->version);
+        return 1;
+    }
+
+    static vrmodPoseExport frame;
+    uint64_t last = 0;
+    for (;;) {
+        while (!vrmodReadPoseExport(shm, &frame))
+            ;
+        if (frame.update != last) {
+            last = frame.update;
+            printf("update %llu  frame %u  interval %.2f ms  dropped %u\n", (unsigned long long)frame.update,
+                   frame.timing.frames, frame.timing.frameInterval * 1000.0f, frame.timing.droppedFrames);
+            for (uint32_t i = 0; i < frame.poseCount; i++) {
+                const vrmodPose* p = &frame.poses[i];
+                printf("  %-24s %s pos %8.3f %8.3f %8.3f  quat %6.3f %6.3f %6.3f %6.3f\n", p->name, p->valid ? "  " : "--",
+                       p->pos[0], p->pos[1], p->pos[2], p->quat[0], p->quat[1], p->quat[2], p->quat[3]);
+            }
+            for (uint32_t i = 0; i < frame.actionCount; i++) {
+                const vrmodAction* a = &frame.actions[i];
+                if (a->type == VRMOD_ACTION_BOOLEAN)
+                    printf("  %-24s %s\n", a->name, a->state ? "true" : "false");
+                else
+                    printf("  %-24s %.3f %.3f\n", a->name, a->x, a->y);
+            }
+        }
+        usleep(250000);
+    }
+}